@@ -11,27 +11,6 @@
 #include "support.hh"
 
 using namespace std;
-void storeExternalDocument(const std::string& id, string suffix, const std::string& content)
-{
-  string fname = makePathForExternalID(id, "op", suffix, true);
-  FILE* t = fopen((fname+".tmp").c_str(), "w");
-  if(!t)
-    throw runtime_error("Unable to open file "+fname+": "+string(strerror(errno)));
-  
-  shared_ptr<FILE> fp(t, fclose);
-  if(fwrite(content.c_str(), 1, content.size(), fp.get()) != content.size()) {
-    unlink(fname.c_str());
-    throw runtime_error("Partial write to file "+fname);
-  }
-  fp.reset();
-  
-  if(rename((fname+".tmp").c_str(), fname.c_str()) < 0) {
-    int e = errno;
-    unlink((fname+".tmp").c_str());
-    throw runtime_error("Unable to rename saved file "+fname+".tmp - "+strerror(e));
-  }
-}
-
 bool knownMissing(const std::string& id)
 {
   static unordered_set<string> missing{"h-tk-20232024-50-2-n1", "h-tk-20232024-50-3-n1", "h-tk-20232024-50-4-n1",
@@ -100,42 +79,44 @@ int main(int argc, char** argv)
     return haveExternalIdFile(eid, "op", suffix) || knownMissing(eid);
   });
   fmt::print("Already had {} external documents, {} left to look at\n", numalready, wantDocs.size());
+  string url="https://repository.officiele-overheidspublicaties.nl";
+  //    string url="https://zoek.officielebekendmakingen.nl";
+  httplib::Client cli(url);
+  cli.set_connection_timeout(10, 0); 
+  cli.set_read_timeout(10, 0); 
+  cli.set_write_timeout(10, 0);
+  cli.set_follow_location(true);
+  cli.set_keep_alive(true);
+  
   for(auto& wd : wantDocs) {
     
     string eid = get<string>(wd["externeidentifier"]);
-
-    string url="https://repository.officiele-overheidspublicaties.nl";
-      //    string url="https://zoek.officielebekendmakingen.nl";
-    httplib::Client cli(url);
-    cli.set_connection_timeout(10, 0); 
-    cli.set_read_timeout(10, 0); 
-    cli.set_write_timeout(10, 0);
-    cli.set_follow_location(true);
-    url += "/officielepublicaties/"+eid+"/"+eid+suffix;
-    fmt::print("Retrieving from {}  ", url);
+    string path = "/officielepublicaties/"+eid+"/"+eid+suffix;
+    fmt::print("Retrieving from {}{}  ", url, path);
     cout.flush();
-    auto res = cli.Get(url);
+    // missing documents get redirected to a friendly 200 page
+    auto d = downloadFile(cli, path, makePathForExternalID(eid, "op", suffix, true), 0, [](const Download& d) {
+      return d.location.find("fout404") == string::npos;
+    });
     
-    if(!res) {
-      auto err = res.error();
-      fmt::print("Oops retrieving from {} -> {}\n", url, httplib::to_string(err));
+    if(d.err != httplib::Error::Success) {
+      fmt::print("Oops retrieving from {}{} -> {}\n", url, path, httplib::to_string(d.err));
       error++;
       continue;
     }
-    if(res->status != 200) {
-      fmt::print("Wrong status code {} for url {}, not storing\n",
-		 res->status, url);
+    if(d.status != 200 && d.status != 206) { // 206 is a resumed download
+      fmt::print("Wrong status code {} for url {}{}, not storing\n",
+		 d.status, url, path);
       error++;
       continue;
     }
-    if(res->location.find("fout404") != string::npos) {
+    if(!d.complete) {
       fmt::print("Fake 404 detected, skipping\n");
       continue;
     }
 
-    storeExternalDocument(eid, "."+ftype, res->body);
     retrieved++;
-    fmt::print("Got {} bytes ({}/{}) \n", res->body.size(), retrieved+error+present, wantDocs.size());
+    fmt::print("Got {} bytes ({}/{}) \n", d.bytes, retrieved+error+present, wantDocs.size());
     usleep(10000);
   }
   fmt::print("Retrieved {} documents, {} were present already, {} errors\n", retrieved, present, error);
@@ -2,47 +2,67 @@
 #include <fmt/format.h>
 #include <fmt/printf.h>
 #include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 #include <vector>
 #include <random>
+#include <thread>
+#include <filesystem>
 #include "siphash.h"
 
 using namespace std;
 
-static bool fileStartsWith(const std::string& fname, const std::string& start)
+FileType sniffFileType(const char* data, size_t len)
 {
-  vector<char> buf(start.size());
+  auto startsWith = [&](const std::string& start) {
+    return len >= start.size() && !memcmp(data, start.c_str(), start.size());
+  };
+  if(startsWith("%PDF"))
+    return FileType::PDF;
+  if(startsWith("PK"))
+    return FileType::Docx;
+  if(startsWith("<?xml") || startsWith("\xef\xbb\xbf<?xml"))
+    return FileType::XML;
+  if(startsWith("\xd0\xcf\x11\xe0"))
+    return FileType::Doc;
+  if(startsWith("{\\rtf1"))
+    return FileType::Rtf;
+  return FileType::Unknown;
+}
+
+FileType sniffFileType(const std::string& fname)
+{
+  char buf[16];
   FILE* fp = fopen(fname.c_str(), "r");
   if(!fp)
-    throw runtime_error("Can't check if "+fname+" is a PDF file, "+string(strerror(errno)));
+    throw runtime_error("Can't check file type of "+fname+", "+string(strerror(errno)));
   shared_ptr<FILE> tfp(fp, fclose);
-  if(fread(&buf[0], 1, buf.size(), tfp.get()) != buf.size())
+  size_t len = fread(buf, 1, sizeof(buf), tfp.get());
+  if(ferror(tfp.get()))
     throw runtime_error("Can't read from "+fname+", "+string(strerror(errno)));
-  return (memcmp(&buf[0], start.c_str(), start.size())==0);
-}
-
-
-bool isPDF(const std::string& fname)
-{
-  return fileStartsWith(fname, "%PDF");
+  return sniffFileType(buf, len);
 }
 
-bool isDocx(const std::string& fname)
+string fileTypeName(FileType type)
 {
-  return fileStartsWith(fname, "PK");
-}
-bool isXML(const std::string& fname)
-{
-  return fileStartsWith(fname, "<?xml") || fileStartsWith(fname, "\xef\xbb\xbf<?xml");
-}
-
-bool isDoc(const std::string& fname)
-{
-  return fileStartsWith(fname, "\xd0\xcf\x11\xe0");
+  switch(type) {
+  case FileType::PDF: return "pdf";
+  case FileType::Docx: return "docx";
+  case FileType::XML: return "xml";
+  case FileType::Doc: return "doc";
+  case FileType::Rtf: return "rtf";
+  case FileType::Unknown: break;
+  }
+  return "";
 }
 
-bool isRtf(const std::string& fname)
+FileType fileTypeFromName(const std::string& name)
 {
-  return fileStartsWith(fname, "{\\rtf1");
+  for(auto t : {FileType::PDF, FileType::Docx, FileType::XML, FileType::Doc, FileType::Rtf})
+    if(name == fileTypeName(t))
+      return t;
+  return FileType::Unknown;
 }
 
 // we add the slash to prefix for you, you need to put the . in the suffix (if you want one)
@@ -75,6 +95,206 @@ string makePathForId(const std::string& id, const std::string& prefix, const std
   return fmt::sprintf("%s/%s/%s/%s%s", prefix,a, b, id, suffix);
 }
 
+static int64_t getMtime(const struct stat& sb)
+{
+  return sb.st_mtim.tv_sec * 1000000000LL + sb.st_mtim.tv_nsec;
+}
+
+EnclosureManifest::EnclosureManifest(const std::string& fname, bool readonly)
+{
+  if(readonly) {
+    d_readers = make_unique<LockedSqw>(fname, max(4U, thread::hardware_concurrency()));
+    return;
+  }
+  setWALMode(fname); // so tkindex can read while tkpull writes
+  d_sqlw = make_unique<SQLiteWriter>(fname);
+  d_sqlw->query("create table if not exists manifest (prefix TEXT, id TEXT, size INT, mtime INT, hash TEXT, type TEXT)");
+  d_sqlw->query("create unique index if not exists manifestidx on manifest(prefix, id)");
+}
+
+FileType EnclosureManifest::store(const std::string& id, const std::string& prefix, const std::string& fname, int64_t size, int64_t mtime)
+{
+  // mapped, not read into memory, tkpull calls this from every download thread and enclosures get big
+  int fd = open(fname.c_str(), O_RDONLY);
+  if(fd < 0)
+    throw runtime_error("Unable to open file "+fname+" for hashing: "+string(strerror(errno)));
+  struct stat sb;
+  if(fstat(fd, &sb) < 0) {
+    int e = errno;
+    close(fd);
+    throw runtime_error("Unable to stat file "+fname+" for hashing: "+string(strerror(e)));
+  }
+  const char* data = "";
+  if(sb.st_size > 0) {
+    void* p = mmap(nullptr, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(p == MAP_FAILED) {
+      int e = errno;
+      close(fd);
+      throw runtime_error("Unable to map file "+fname+" for hashing: "+string(strerror(e)));
+    }
+    madvise(p, sb.st_size, MADV_SEQUENTIAL);
+    data = (const char*)p;
+  }
+  close(fd);
+  shared_ptr<const char> mapping(data, [len = sb.st_size](const char* p) {
+    if(len > 0)
+      munmap((void*)p, len);
+  });
+
+  static unsigned char k[16]={1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15};
+  unsigned char out[8]={};
+  siphash((const void*) data, sb.st_size, k, out, sizeof(out));
+  string hash = fmt::sprintf("%02x%02x%02x%02x%02x%02x%02x%02x", out[0], out[1], out[2], out[3], out[4], out[5], out[6], out[7]);
+  FileType type = sniffFileType(data, min((size_t)sb.st_size, (size_t)16));
+  mapping.reset();
+
+  auto& sqlw = writer();
+  lock_guard<mutex> l(d_lock);
+  sqlw.addOrReplaceValue({{"prefix", prefix}, {"id", id}, {"size", size}, {"mtime", mtime}, {"hash", hash}, {"type", fileTypeName(type)}}, "manifest");
+  return type;
+}
+
+void EnclosureManifest::record(const std::string& id, const std::string& prefix)
+{
+  string fname = makePathForId(id, prefix);
+  struct stat sb;
+  if(stat(fname.c_str(), &sb) < 0) {
+    forget(id, prefix);
+    return;
+  }
+  store(id, prefix, fname, sb.st_size, getMtime(sb));
+}
+
+void EnclosureManifest::forget(const std::string& id, const std::string& prefix)
+{
+  auto& sqlw = writer();
+  lock_guard<mutex> l(d_lock);
+  sqlw.queryT("delete from manifest where prefix=? and id=?", {prefix, id});
+}
+
+SQLiteWriter& EnclosureManifest::writer()
+{
+  if(!d_sqlw)
+    throw runtime_error("Can't change a read-only enclosure manifest");
+  return *d_sqlw;
+}
+
+std::vector<std::unordered_map<std::string, MiniSQLite::outvar_t>> EnclosureManifest::query(const std::string& q, const std::initializer_list<SQLiteWriter::var_t>& values)
+{
+  if(d_readers) {
+    try {
+      return d_readers->query(q, values);
+    }
+    catch(std::exception&) {
+      // tkpull makes the manifest, until then we know nothing
+      return {};
+    }
+  }
+  lock_guard<mutex> l(d_lock);
+  return d_sqlw->queryT(q, values);
+}
+
+static EnclosureManifest::Entry rowToEntry(unordered_map<string, MiniSQLite::outvar_t>& r)
+{
+  EnclosureManifest::Entry e{get<int64_t>(r["size"]), get<int64_t>(r["mtime"]), get<string>(r["hash"]), FileType::Unknown};
+  if(auto type = get_if<string>(&r["type"]))
+    e.type = fileTypeFromName(*type);
+  return e;
+}
+
+std::optional<EnclosureManifest::Entry> EnclosureManifest::get(const std::string& id, const std::string& prefix)
+{
+  auto rows = query("select size, mtime, hash, type from manifest where prefix=? and id=?", {prefix, id});
+  if(rows.empty())
+    return std::nullopt;
+  return rowToEntry(rows[0]);
+}
+
+std::unordered_map<std::string, EnclosureManifest::Entry> EnclosureManifest::getAll(const std::string& prefix)
+{
+  auto rows = query("select id, size, mtime, hash, type from manifest where prefix=?", {prefix});
+  unordered_map<string, Entry> ret;
+  ret.reserve(rows.size());
+  for(auto& r : rows)
+    ret.emplace(std::get<string>(r["id"]), rowToEntry(r));
+  return ret;
+}
+
+bool EnclosureManifest::isPresentNonEmpty(const std::string& id, const std::string& prefix)
+{
+  auto e = get(id, prefix);
+  return e && e->size > 0;
+}
+
+bool EnclosureManifest::isPresentRightSize(const std::string& id, int64_t size, const std::string& prefix)
+{
+  auto e = get(id, prefix);
+  return e && e->size == size;
+}
+
+FileType EnclosureManifest::getFileType(const std::string& id, const std::string& prefix)
+{
+  string fname = makePathForId(id, prefix);
+  struct stat sb;
+  if(stat(fname.c_str(), &sb) < 0)
+    throw runtime_error("Can't check file type of "+fname+", "+string(strerror(errno)));
+  auto e = get(id, prefix);
+  if(e && e->size == sb.st_size && e->mtime == getMtime(sb))
+    return e->type;
+  if(!d_sqlw) // no need to hash it if we don't get to record it
+    return sniffFileType(fname);
+  return store(id, prefix, fname, sb.st_size, getMtime(sb));
+}
+
+unsigned int EnclosureManifest::reconcile(const std::string& prefix)
+{
+  writer();
+  auto known = getAll(prefix);
+  unsigned int changes = 0;
+  error_code ec;
+  // prefix/a/b/id, see makePathForId
+  for(const auto& f : filesystem::recursive_directory_iterator(prefix, ec)) {
+    if(!f.is_regular_file(ec))
+      continue;
+    string id = f.path().filename().string();
+    if(id.size() < 10 || id.find_first_not_of("0123456789-abcdef") != string::npos) // skips .tmp files too
+      continue;
+    string fname = f.path().string();
+    struct stat sb;
+    if(stat(fname.c_str(), &sb) < 0)
+      continue; // gone already
+    auto iter = known.find(id);
+    if(iter == known.end() || iter->second.size != sb.st_size || iter->second.mtime != getMtime(sb)) {
+      try {
+        store(id, prefix, fname, sb.st_size, getMtime(sb));
+        changes++;
+      }
+      catch(std::exception& e) {
+        fmt::print("Could not add {} to manifest: {}\n", fname, e.what());
+      }
+    }
+    if(iter != known.end())
+      known.erase(iter);
+  }
+  if(ec)
+    throw runtime_error("Unable to scan "+prefix+" for the manifest: "+ec.message());
+  // what is left is no longer on disk
+  for(const auto& k : known) {
+    forget(k.first, prefix);
+    changes++;
+  }
+  return changes;
+}
+
+void EnclosureManifest::bootstrap(const std::string& prefix)
+{
+  writer();
+  if(!query("select 1 from manifest where prefix=? limit 1", {prefix}).empty())
+    return;
+  fmt::print("No manifest for {} yet, scanning\n", prefix);
+  fmt::print("Manifest for {} now has {} entries\n", prefix, reconcile(prefix));
+}
+
 bool isPresentNonEmpty(const std::string& id, const std::string& prefix, const std::string& suffix)
 {
   struct stat sb;
@@ -194,3 +414,483 @@ string getSubdirForExternalID(const std::string& in)
   siphash((const void*) in.c_str(), in.length(), k, out, outlen);
   return fmt::sprintf("%02x/%02x", out[4], out[6]);
 }
+
+SQLiteReader::SQLiteReader(const std::string& fname, const std::vector<std::string>& initqueries) : d_fname(fname)
+{
+  // NOMUTEX because a connection is only ever used by one thread at a time
+  if(sqlite3_open_v2(fname.c_str(), &d_db, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, nullptr) != SQLITE_OK) {
+    string err = d_db ? sqlite3_errmsg(d_db) : "out of memory";
+    sqlite3_close(d_db);
+    throw runtime_error("Unable to open "+fname+" read-only: "+err);
+  }
+  sqlite3_busy_timeout(d_db, 5000);
+  for(const auto& q : initqueries) {
+    char* errmsg = nullptr;
+    if(sqlite3_exec(d_db, q.c_str(), nullptr, nullptr, &errmsg) != SQLITE_OK) {
+      string err = errmsg ? errmsg : "unknown error";
+      sqlite3_free(errmsg);
+      sqlite3_close(d_db);
+      throw runtime_error("Error running '"+q+"' on "+fname+": "+err);
+    }
+  }
+}
+
+SQLiteReader::~SQLiteReader()
+{
+  for(auto& s : d_stmts)
+    sqlite3_finalize(s.second);
+  sqlite3_close(d_db);
+}
+
+sqlite3_stmt* SQLiteReader::getStatement(const std::string& q)
+{
+  if(auto iter = d_stmts.find(q); iter != d_stmts.end())
+    return iter->second;
+
+  if(d_stmts.size() > 1000) { // someone is not using placeholders
+    for(auto& s : d_stmts)
+      sqlite3_finalize(s.second);
+    d_stmts.clear();
+  }
+  sqlite3_stmt* stmt;
+  if(sqlite3_prepare_v3(d_db, q.c_str(), -1, SQLITE_PREPARE_PERSISTENT, &stmt, nullptr) != SQLITE_OK)
+    throw runtime_error("Error preparing query '"+q+"' on "+d_fname+": "+sqlite3_errmsg(d_db));
+  d_stmts[q] = stmt;
+  return stmt;
+}
+
+void SQLiteReader::queryEach(const std::string& q, const std::initializer_list<SQLiteWriter::var_t>& values, const std::function<void(sqlite3_stmt*)>& f)
+{
+  sqlite3_stmt* stmt = getStatement(q);
+  // a statement that is not reset keeps its read transaction open, and we'd not see new data
+  shared_ptr<sqlite3_stmt> st(stmt, [](sqlite3_stmt* s) {
+    sqlite3_reset(s);
+    sqlite3_clear_bindings(s);
+  });
+  
+  int n = 1;
+  for(const auto& v : values) {
+    int rc = std::visit([&](auto&& arg) {
+      using T = std::decay_t<decltype(arg)>;
+      if constexpr (std::is_same_v<T, std::string>)
+        return sqlite3_bind_text(stmt, n, arg.c_str(), arg.size(), SQLITE_TRANSIENT);
+      else if constexpr (std::is_same_v<T, std::vector<uint8_t>>)
+        return sqlite3_bind_blob(stmt, n, arg.data(), arg.size(), SQLITE_TRANSIENT);
+      else if constexpr (std::is_floating_point_v<T>)
+        return sqlite3_bind_double(stmt, n, arg);
+      else
+        return sqlite3_bind_int64(stmt, n, arg);
+    }, v);
+    if(rc != SQLITE_OK)
+      throw runtime_error("Error binding value "+to_string(n)+" for query '"+q+"': "+sqlite3_errmsg(d_db));
+    n++;
+  }
+
+  for(;;) {
+    int rc = sqlite3_step(stmt);
+    if(rc == SQLITE_DONE)
+      break;
+    if(rc != SQLITE_ROW)
+      throw runtime_error("Error executing query '"+q+"' on "+d_fname+": "+sqlite3_errmsg(d_db));
+    f(stmt);
+  }
+}
+
+vector<unordered_map<string,MiniSQLite::outvar_t>> SQLiteReader::queryT(const std::string& q, const std::initializer_list<SQLiteWriter::var_t>& values)
+{
+  vector<unordered_map<string,MiniSQLite::outvar_t>> ret;
+  queryEach(q, values, [&ret](sqlite3_stmt* stmt) {
+    unordered_map<string,MiniSQLite::outvar_t> row;
+    int cols = sqlite3_column_count(stmt);
+    for(int c = 0; c < cols; ++c) {
+      const char* name = sqlite3_column_name(stmt, c);
+      switch(sqlite3_column_type(stmt, c)) {
+      case SQLITE_INTEGER:
+        row[name] = (int64_t)sqlite3_column_int64(stmt, c);
+        break;
+      case SQLITE_FLOAT:
+        row[name] = sqlite3_column_double(stmt, c);
+        break;
+      case SQLITE_BLOB: {
+        auto p = (const uint8_t*)sqlite3_column_blob(stmt, c);
+        row[name] = vector<uint8_t>(p, p + sqlite3_column_bytes(stmt, c));
+        break;
+      }
+      case SQLITE_NULL:
+        row[name] = nullptr;
+        break;
+      default:
+        row[name] = string((const char*)sqlite3_column_text(stmt, c), sqlite3_column_bytes(stmt, c));
+      }
+    }
+    ret.push_back(std::move(row));
+  });
+  return ret;
+}
+
+void storeFeedPages(SQLiteWriter& sqlw, BoundedQueue<FeedPage>& pages, unsigned int batchsize, std::atomic<bool>& failed)
+{
+  FeedPage page;
+  unsigned int pending = 0;
+  bool intx = false; // a caught up category sends pages without entries, so pending doesn't tell
+  while(pages.pop(page)) {
+    if(failed)
+      continue;
+    try {
+      if(!intx) {
+        sqlw.query("begin");
+        intx = true;
+      }
+      for(auto& fe : page.entries)
+        sqlw.addValue({{"category", page.category},{"id", fe.id}, {"skiptoken", fe.skiptoken}, {"enclosure", fe.enclosure}, {"updated", fe.updated},
+                       {"xml", fe.zxml.empty() ? SQLiteWriter::var_t(fe.xml) : SQLiteWriter::var_t(fe.zxml)}}, page.category);
+      pending += page.entries.size();
+      if(pending >= batchsize || !pages.size()) {
+        sqlw.query("commit");
+        intx = false;
+        pending = 0;
+      }
+    }
+    catch(std::exception& e) {
+      fmt::print("Error storing entries for {}: {}\n", page.category, e.what());
+      failed = true;
+      if(intx) {
+        try { sqlw.query("rollback"); } catch(...) {}
+        intx = false;
+      }
+    }
+  }
+  if(intx && !failed)
+    sqlw.query("commit");
+}
+
+void TokenBucket::take()
+{
+  unique_lock<mutex> l(d_lock);
+  for(;;) {
+    auto now = chrono::steady_clock::now();
+    d_tokens = min(d_burst, d_tokens + d_rate * chrono::duration<double>(now - d_last).count());
+    d_last = now;
+    if(d_tokens >= 1) {
+      d_tokens -= 1;
+      return;
+    }
+    // sleeping with the lock held is fine, anyone else would be waiting for the same token
+    this_thread::sleep_for(chrono::duration<double>((1 - d_tokens) / d_rate));
+  }
+}
+
+BlobCache::BlobCache(size_t maxbytes, unsigned int shards) : d_shardbytes(maxbytes / max(1U, shards))
+{
+  for(unsigned int n = 0; n < max(1U, shards); ++n)
+    d_shards.push_back(make_unique<Shard>());
+}
+
+BlobCache::Shard& BlobCache::getShard(const std::string& key)
+{
+  return *d_shards[std::hash<string>{}(key) % d_shards.size()];
+}
+
+std::shared_ptr<const std::string> BlobCache::get(const std::string& key)
+{
+  if(key.empty())
+    return nullptr;
+  auto& shard = getShard(key);
+  lock_guard<mutex> l(shard.lock);
+  auto iter = shard.index.find(key);
+  if(iter == shard.index.end())
+    return nullptr;
+  shard.lru.splice(shard.lru.begin(), shard.lru, iter->second);
+  return iter->second->second;
+}
+
+std::shared_ptr<const std::string> BlobCache::put(const std::string& key, std::string&& blob)
+{
+  auto ret = make_shared<const string>(std::move(blob));
+  if(key.empty() || ret->size() > d_shardbytes)
+    return ret;
+  auto& shard = getShard(key);
+  lock_guard<mutex> l(shard.lock);
+  if(auto iter = shard.index.find(key); iter != shard.index.end()) {
+    shard.bytes -= iter->second->second->size();
+    shard.lru.erase(iter->second);
+    shard.index.erase(iter);
+  }
+  shard.lru.push_front({key, ret});
+  shard.index[key] = shard.lru.begin();
+  shard.bytes += ret->size();
+  while(shard.bytes > d_shardbytes) {
+    auto& last = shard.lru.back();
+    shard.bytes -= last.second->size();
+    shard.index.erase(last.first);
+    shard.lru.pop_back();
+  }
+  return ret;
+}
+
+ConversionService::ConversionService(unsigned int workers, size_t maxqueue) : d_maxqueue(maxqueue)
+{
+  for(unsigned int n = 0; n < workers; ++n)
+    d_workers.emplace_back(&ConversionService::worker, this);
+}
+
+ConversionService::~ConversionService()
+{
+  {
+    lock_guard<mutex> l(d_lock);
+    d_stop = true;
+  }
+  d_cond.notify_all();
+  for(auto& w : d_workers)
+    w.join();
+}
+
+std::string ConversionService::get(const std::string& key, std::function<std::string()> f)
+{
+  shared_future<string> fut;
+  {
+    lock_guard<mutex> l(d_lock);
+    if(auto iter = d_inflight.find(key); iter != d_inflight.end()) {
+      fmt::print("Waiting for conversion of {} that is already in flight\n", key);
+      fut = iter->second;
+    }
+    else {
+      if(d_queue.size() >= d_maxqueue)
+        throw Busy();
+      packaged_task<string()> task(std::move(f));
+      fut = task.get_future().share();
+      d_inflight[key] = fut;
+      d_queue.push_back({key, std::move(task)});
+      d_cond.notify_one();
+    }
+  }
+  return fut.get();
+}
+
+size_t ConversionService::queued()
+{
+  lock_guard<mutex> l(d_lock);
+  return d_queue.size();
+}
+
+void ConversionService::worker()
+{
+  for(;;) {
+    Job job;
+    {
+      unique_lock<mutex> l(d_lock);
+      d_cond.wait(l, [this]() { return d_stop || !d_queue.empty(); });
+      if(d_queue.empty())
+        return;
+      job = std::move(d_queue.front());
+      d_queue.pop_front();
+    }
+    job.task(); // exceptions end up in the future
+    lock_guard<mutex> l(d_lock);
+    d_inflight.erase(job.key);
+  }
+}
+
+Download downloadFile(httplib::Client& cli, const std::string& path, const std::string& fname, int64_t expected,
+                      const std::function<bool(const Download&)>& accept)
+{
+  string tmpname = fname + ".tmp";
+  Download ret;
+  uint64_t offset = 0;
+  struct stat sb;
+  if(!stat(tmpname.c_str(), &sb) && sb.st_size > 0 && (!expected || sb.st_size < expected))
+    offset = sb.st_size;
+
+  httplib::Headers headers;
+  if(offset)
+    headers.insert({"Range", "bytes="+to_string(offset)+"-"});
+
+  // we don't throw from within httplib, but stop the transfer and report afterwards
+  shared_ptr<FILE> fp;
+  string fileerror;
+  bool discard = false;
+  auto res = cli.Get(path, headers, [&](const httplib::Response& r) {
+    if(r.status == 206) {
+      // Content-Range: bytes 1000-4999/5000
+      if(r.get_header_value("Content-Range").find("bytes "+to_string(offset)+"-")) {
+	discard = true;
+	return false;
+      }
+    }
+    else if(r.status == 200)
+      offset = 0; // server ignored our Range, start over
+    else
+      return true; // we don't store this, the caller gets to see the status
+    FILE* t = fopen(tmpname.c_str(), offset ? "a" : "w");
+    if(!t) {
+      fileerror = "Unable to open file "+tmpname+": "+string(strerror(errno));
+      return false;
+    }
+    fp = shared_ptr<FILE>(t, fclose);
+    return true;
+  }, [&](const char* data, size_t len) {
+    if(!fp)
+      return true;
+    if(fwrite(data, 1, len, fp.get()) != len) {
+      fileerror = "Partial write to file "+tmpname+": "+string(strerror(errno));
+      return false;
+    }
+    ret.bytes += len;
+    if(expected && (int64_t)(offset + ret.bytes) > expected) { // more than we bargained for
+      discard = true;
+      return false;
+    }
+    return true;
+  });
+
+  ret.size = offset + ret.bytes;
+  fp.reset();
+  if(!fileerror.empty())
+    throw runtime_error(fileerror);
+  if(!res) {
+    ret.err = res.error();
+    if(discard)
+      unlink(tmpname.c_str());
+    // otherwise the partial .tmp stays for next time
+    return ret;
+  }
+  ret.status = res->status;
+  ret.location = res->location;
+  if(ret.status != 200 && ret.status != 206) {
+    // a 416 (or anything else) for our Range: the .tmp is complete or useless, either way next time we start over
+    if(offset)
+      unlink(tmpname.c_str());
+    return ret;
+  }
+
+  if(int fd = open(tmpname.c_str(), O_RDONLY); fd < 0 || fsync(fd) < 0) {
+    int e = errno;
+    if(fd >= 0)
+      close(fd);
+    throw runtime_error("Unable to sync file "+tmpname+": "+string(strerror(e)));
+  }
+  else
+    close(fd);
+
+  if((expected && (int64_t)ret.size != expected) || (accept && !accept(ret))) {
+    unlink(tmpname.c_str());
+    return ret;
+  }
+  if(rename(tmpname.c_str(), fname.c_str()) < 0) {
+    int e = errno;
+    unlink(tmpname.c_str());
+    throw runtime_error("Unable to rename saved file "+tmpname+" - "+strerror(e));
+  }
+  ret.complete = true;
+  return ret;
+}
+
+bool shouldRetry(const Download& d)
+{
+  return d.err != httplib::Error::Success || d.status == 429 || d.status >= 500;
+}
+
+uint64_t backoffUsec(int attempt)
+{
+  return (1000000ULL << (attempt - 1)) + getRandom64() % 500000;
+}
+
+bool retrieveFile(httplib::Client& cli, const std::string& path, const std::string& fname, int64_t expected,
+                  TokenBucket& tb, std::atomic<uint64_t>& bytes, int maxretries,
+                  const std::function<void(uint64_t usec)>& sleep)
+{
+  for(int attempt = 0; ; ++attempt) {
+    if(attempt) {
+      if(sleep)
+        sleep(backoffUsec(attempt));
+      else
+        usleep(backoffUsec(attempt));
+    }
+    tb.take();
+    auto d = downloadFile(cli, path, fname, expected);
+    bytes += d.bytes;
+    string problem;
+    if(d.err != httplib::Error::Success)
+      problem = httplib::to_string(d.err); // a partial file gets resumed on the next attempt
+    else if(d.status == 200 || d.status == 206) {
+      if(!d.complete) {
+        fmt::print("{} has {} bytes, expected {}, not storing\n", path, d.size, expected);
+        return false;
+      }
+      if(d.status == 206)
+        fmt::print("Got remaining {} bytes of {} from {}\n", d.bytes, d.size, path);
+      else
+        fmt::print("Got {} bytes from {}\n", d.bytes, path);
+      return true;
+    }
+    else if(!shouldRetry(d)) {
+      fmt::print("Wrong status code {} for url {}, not storing\n", d.status, path);
+      return false;
+    }
+    else
+      problem = "status code "+to_string(d.status);
+
+    if(attempt == maxretries) {
+      fmt::print("Oops retrieving from {} -> {}, giving up\n", path, problem);
+      return false;
+    }
+    fmt::print("Problem retrieving from {} -> {}, will retry\n", path, problem);
+  }
+}
+
+shared_ptr<SQLiteReader> LockedSqw::getConnection()
+{
+  SQLiteReader* sqr = nullptr;
+  {
+    unique_lock<mutex> l(d_lock);
+    d_cond.wait(l, [this]() { return !d_free.empty() || d_numconns < d_maxconns; });
+    if(!d_free.empty()) {
+      sqr = d_free.back().release();
+      d_free.pop_back();
+    }
+    else
+      d_numconns++; // we make a new one below, outside of the lock
+  }
+  if(!sqr) {
+    try {
+      sqr = new SQLiteReader(d_fname, d_initqueries);
+    }
+    catch(...) {
+      lock_guard<mutex> l(d_lock);
+      d_numconns--;
+      d_cond.notify_one();
+      throw;
+    }
+  }
+  return shared_ptr<SQLiteReader>(sqr, [this](SQLiteReader* s) { returnConnection(s); });
+}
+
+void LockedSqw::returnConnection(SQLiteReader* sqr)
+{
+  lock_guard<mutex> l(d_lock);
+  d_free.emplace_back(sqr);
+  d_cond.notify_one();
+}
+
+unsigned int LockedSqw::numConnections()
+{
+  lock_guard<mutex> l(d_lock);
+  return d_numconns;
+}
+
+void setWALMode(const std::string& fname)
+{
+  sqlite3* db;
+  if(sqlite3_open(fname.c_str(), &db) != SQLITE_OK) {
+    string err = db ? sqlite3_errmsg(db) : "out of memory";
+    sqlite3_close(db);
+    throw runtime_error("Unable to open "+fname+" to set WAL mode: "+err);
+  }
+  shared_ptr<sqlite3> sdb(db, sqlite3_close);
+  char* errmsg = nullptr;
+  if(sqlite3_exec(db, "pragma journal_mode=WAL", nullptr, nullptr, &errmsg) != SQLITE_OK) {
+    string err = errmsg ? errmsg : "unknown error";
+    sqlite3_free(errmsg);
+    throw runtime_error("Unable to set WAL mode on "+fname+": "+err);
+  }
+}
@@ -5,6 +5,19 @@
 #include "nlohmann/json.hpp"
 #include "sqlwriter.hh"
 #include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <vector>
+#include <deque>
+#include <list>
+#include <unordered_map>
+#include <functional>
+#include <optional>
+#include <future>
+#include <thread>
+#include <atomic>
+#include <stdexcept>
+#include <sqlite3.h>
 #include "httplib.h"
 
 struct DTime
@@ -13,7 +26,7 @@ struct DTime
   {
     d_start =   std::chrono::steady_clock::now();
   }
-  uint32_t lapUsec()
+  uint64_t lapUsec()
   {
     auto usec = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now()- d_start).count();
     start();
@@ -23,17 +36,174 @@ struct DTime
   std::chrono::time_point<std::chrono::steady_clock> d_start;
 };
 
+// Queue between threads, push() waits while it is full. After close(), push() returns false and
+// pop() returns false once everything that was queued has been popped
+template<typename T>
+class BoundedQueue
+{
+public:
+  explicit BoundedQueue(size_t maxsize) : d_maxsize(maxsize) {}
+  bool push(T&& t)
+  {
+    std::unique_lock<std::mutex> l(d_lock);
+    d_notfull.wait(l, [this]() { return d_queue.size() < d_maxsize || d_closed; });
+    if(d_closed)
+      return false;
+    d_queue.push_back(std::move(t));
+    d_notempty.notify_one();
+    return true;
+  }
+  bool pop(T& t)
+  {
+    std::unique_lock<std::mutex> l(d_lock);
+    d_notempty.wait(l, [this]() { return !d_queue.empty() || d_closed; });
+    if(d_queue.empty())
+      return false;
+    t = std::move(d_queue.front());
+    d_queue.pop_front();
+    d_notfull.notify_one();
+    return true;
+  }
+  void close()
+  {
+    std::lock_guard<std::mutex> l(d_lock);
+    d_closed = true;
+    d_notfull.notify_all();
+    d_notempty.notify_all();
+  }
+  size_t size()
+  {
+    std::lock_guard<std::mutex> l(d_lock);
+    return d_queue.size();
+  }
+private:
+  std::deque<T> d_queue;
+  size_t d_maxsize;
+  bool d_closed{false};
+  std::mutex d_lock;
+  std::condition_variable d_notfull, d_notempty;
+};
+
+// one page of a SyncFeed category, as tkgetxml parsed it
+struct FeedEntry
+{
+  std::string id, updated, enclosure, xml;
+  std::vector<uint8_t> zxml; // if set, xml is not used
+  int skiptoken;
+};
+
+struct FeedPage
+{
+  std::string category;
+  std::vector<FeedEntry> entries;
+};
+
+/* Stores pages until the queue is closed, in transactions of at least batchsize entries that always end on
+   a page boundary, or sooner if nothing else is queued. sqlw must be opened with SQLWFlag::NoTransactions.
+   On an error we roll back, set failed and keep draining the queue so nobody blocks on us */
+void storeFeedPages(SQLiteWriter& sqlw, BoundedQueue<FeedPage>& pages, unsigned int batchsize, std::atomic<bool>& failed);
+
+// Rate limit shared between threads. take() waits until there is a token, tokens come in at
+// 'rate' per second and at most 'burst' of them get saved up
+class TokenBucket
+{
+public:
+  TokenBucket(double rate, double burst) : d_rate(rate), d_burst(burst), d_tokens(burst), d_last(std::chrono::steady_clock::now()) {}
+  void take();
+private:
+  std::mutex d_lock;
+  double d_rate, d_burst, d_tokens;
+  std::chrono::steady_clock::time_point d_last;
+};
+
+/* Runs slow conversions (pandoc, pdftohtml, convert) on a fixed number of threads. If a conversion for
+   the same key is already queued or running, get() waits for that one instead of starting another.
+   With more than maxqueue conversions waiting to start, get() throws Busy, which tkserv turns into a 503 */
+class ConversionService
+{
+public:
+  struct Busy : public std::runtime_error
+  {
+    Busy() : std::runtime_error("Too many conversions queued") {}
+  };
+  ConversionService(unsigned int workers, size_t maxqueue);
+  ConversionService(const ConversionService&) = delete;
+  ~ConversionService();
+  // blocks until f (or the one already in flight for key) is done, and rethrows what it threw
+  std::string get(const std::string& key, std::function<std::string()> f);
+  size_t queued();
+private:
+  void worker();
+  struct Job
+  {
+    std::string key;
+    std::packaged_task<std::string()> task;
+  };
+  size_t d_maxqueue;
+  std::deque<Job> d_queue;
+  std::unordered_map<std::string, std::shared_future<std::string>> d_inflight;
+  std::vector<std::thread> d_workers;
+  bool d_stop{false};
+  std::mutex d_lock;
+  std::condition_variable d_cond;
+};
+
+/* Size bounded LRU of immutable blobs, rendered HTML and photos for example. Split into shards that each have
+   their own lock and an equal part of maxbytes. What you get is shared, so it stays valid after eviction */
+class BlobCache
+{
+public:
+  explicit BlobCache(size_t maxbytes, unsigned int shards = 16);
+  // nullptr if we don't have it, or if key is empty
+  std::shared_ptr<const std::string> get(const std::string& key);
+  // stores unless key is empty or blob is too big for a shard, returns the shared version either way
+  std::shared_ptr<const std::string> put(const std::string& key, std::string&& blob);
+private:
+  struct Shard
+  {
+    std::mutex lock;
+    std::list<std::pair<std::string, std::shared_ptr<const std::string>>> lru; // most recent in front
+    std::unordered_map<std::string, decltype(lru)::iterator> index;
+    size_t bytes{0};
+  };
+  Shard& getShard(const std::string& key);
+  std::vector<std::unique_ptr<Shard>> d_shards;
+  size_t d_shardbytes;
+};
+
+// A read-only connection with the same queryT interface as SQLiteWriter. Not thread safe,
+// use it from one thread at a time, for example via LockedSqw below.
+// Prepared statements are kept around keyed on the query text, so use ? placeholders
+// and not values pasted into the query. initqueries get run once after opening, think ATTACH
+class SQLiteReader
+{
+public:
+  explicit SQLiteReader(const std::string& fname, const std::vector<std::string>& initqueries = {});
+  SQLiteReader(const SQLiteReader&) = delete;
+  ~SQLiteReader();
+  std::vector<std::unordered_map<std::string,MiniSQLite::outvar_t>> queryT(const std::string& q, const std::initializer_list<SQLiteWriter::var_t>& values = {});
+  // calls f for every row as it comes in, so nothing piles up in memory. The sqlite3_column_* values are only valid until f returns
+  void queryEach(const std::string& q, const std::initializer_list<SQLiteWriter::var_t>& values, const std::function<void(sqlite3_stmt*)>& f);
+private:
+  sqlite3_stmt* getStatement(const std::string& q);
+  sqlite3* d_db{nullptr};
+  std::string d_fname;
+  std::unordered_map<std::string, sqlite3_stmt*> d_stmts;
+};
+
+// Pool of read-only connections, handed out to whichever thread needs one. Grows up to maxconns,
+// after that callers wait for a connection to come back. The database should be in WAL mode
+// (see setWALMode) so the readers don't block on tkconv writing
 struct LockedSqw
 {
   LockedSqw(const LockedSqw&) = delete;
-  LockedSqw(SQLiteWriter& sqw_, std::mutex& sqwlock_) : sqw(sqw_), sqwlock(sqwlock_){}
+  LockedSqw(const std::string& fname, unsigned int maxconns, const std::vector<std::string>& initqueries = {}) :
+    d_fname(fname), d_maxconns(maxconns), d_initqueries(initqueries) {}
   
-  SQLiteWriter& sqw;
-  std::mutex& sqwlock;
   auto query(const std::string& query, const std::initializer_list<SQLiteWriter::var_t>& values ={})
   {
-    std::lock_guard<std::mutex> l(sqwlock);
-    return sqw.queryT(query, values);
+    auto sqr = getConnection();
+    return sqr->queryT(query, values);
   }
 
   void queryJ(httplib::Response &res, const std::string& q, const std::initializer_list<SQLiteWriter::var_t>& values={}) 
@@ -47,20 +217,25 @@ struct LockedSqw
     auto result = query(q, values);
     return packResultsJson(result);
   }
-  
-  void addValue(const std::initializer_list<std::pair<const char*, SQLiteWriter::var_t>>& values, const std::string& table="data")
-  {
-    std::lock_guard<std::mutex> l(sqwlock);
-    sqw.addValue(values, table);
-  }
-  void addValue(const std::vector<std::pair<const char*, SQLiteWriter::var_t>>& values, const std::string& table="data")
-  {
-    std::lock_guard<std::mutex> l(sqwlock);
-    sqw.addValue(values, table);
-  }
 
+  // returns a connection to the pool when the last copy of the shared_ptr goes away
+  std::shared_ptr<SQLiteReader> getConnection();
+  unsigned int numConnections();
+  
+private:
+  void returnConnection(SQLiteReader* sqr);
+  std::string d_fname;
+  unsigned int d_maxconns;
+  std::vector<std::string> d_initqueries;
+  unsigned int d_numconns{0};
+  std::vector<std::unique_ptr<SQLiteReader>> d_free;
+  std::mutex d_lock;
+  std::condition_variable d_cond;
 };
 
+// switch database to WAL mode, which is persistent. Can't be done from within a transaction, so call this before opening an SQLiteWriter
+void setWALMode(const std::string& fname);
+
 // we add the / to prefix for you
 std::string makePathForId(const std::string& id, const std::string& prefix="docs", const std::string& suffix="", bool makepath=false);
 
@@ -72,13 +247,81 @@ std::string getSubdirForExternalID(const std::string& in);
 
 std::string makePathForExternalID(const std::string& id, const std::string& prefix="op", const std::string& suffix=".odt", bool makepath=false);
 
+struct Download
+{
+  httplib::Error err{httplib::Error::Success};
+  int status{0};
+  uint64_t bytes{0}; // received this time
+  uint64_t size{0};  // of the whole file
+  std::string location;
+  bool complete{false}; // and renamed into place
+};
+
+/* Streams path into fname.tmp, and renames that to fname once it is complete and fsynced.
+   If a .tmp is left over from an earlier attempt, we ask for the rest of it with a Range request.
+   If expected is not 0, anything other than exactly that many bytes is an error. accept() gets to veto
+   a completed download before it is renamed. Throws on trouble with the file, HTTP problems end up in the Download */
+Download downloadFile(httplib::Client& cli, const std::string& path, const std::string& fname, int64_t expected,
+                      const std::function<bool(const Download&)>& accept = nullptr);
+// connection trouble, 429 and 5xx are worth another attempt, any other answer is final
+bool shouldRetry(const Download& d);
+// wait before retry number attempt: 1, 2, 4.. seconds, plus some jitter so threads don't retry in lockstep
+uint64_t backoffUsec(int attempt);
+/* downloadFile() behind the rate limit, retrying what shouldRetry() says with backoffUsec() in between, at
+   most maxretries times. sleep replaces usleep, for tests. Returns true if fname is complete */
+bool retrieveFile(httplib::Client& cli, const std::string& path, const std::string& fname, int64_t expected,
+                  TokenBucket& tb, std::atomic<uint64_t>& bytes, int maxretries = 5,
+                  const std::function<void(uint64_t usec)>& sleep = nullptr);
+
+enum class FileType { Unknown, PDF, Docx, XML, Doc, Rtf };
+// reads the start of fname once and tells you what it is. Throws if the file can't be opened
+FileType sniffFileType(const std::string& fname);
+FileType sniffFileType(const char* data, size_t len);
+// "pdf", "docx" etc, "" for Unknown. This is what ends up in the manifest
+std::string fileTypeName(FileType type);
+FileType fileTypeFromName(const std::string& name);
+
+/* Keeps track of the enclosures we have on disk, so tools don't need to stat() hundreds of thousands
+   of files to find out. Lives in enclosures.sqlite3, keyed on prefix ("docs", "photos") and id.
+   Whoever stores an enclosure should record() it once it has been renamed into place, reconcile()
+   fixes up whatever happened behind our back. A readonly manifest is for tkserv, which must not contend
+   with tkpull: it only reads, and getFileType() sniffs files it doesn't know without recording them. Thread safe */
+class EnclosureManifest
+{
+public:
+  struct Entry
+  {
+    int64_t size;
+    int64_t mtime; // nanoseconds
+    std::string hash; // siphash of the contents
+    FileType type;
+  };
+  explicit EnclosureManifest(const std::string& fname = "enclosures.sqlite3", bool readonly = false);
+  // stats & hashes the file, or forgets about it if it is not there
+  void record(const std::string& id, const std::string& prefix="docs");
+  void forget(const std::string& id, const std::string& prefix="docs");
+  std::optional<Entry> get(const std::string& id, const std::string& prefix="docs");
+  // everything for a prefix in one go, for sweeps over all documents
+  std::unordered_map<std::string, Entry> getAll(const std::string& prefix="docs");
+  bool isPresentNonEmpty(const std::string& id, const std::string& prefix="docs");
+  bool isPresentRightSize(const std::string& id, int64_t size, const std::string& prefix="docs");
+  // the type we sniffed before, if size and mtime still match. Otherwise sniffs and records the file again
+  FileType getFileType(const std::string& id, const std::string& prefix="docs");
+  // walks prefix/ and brings the manifest in line with it, only hashing files that changed. Returns number of changes
+  unsigned int reconcile(const std::string& prefix="docs");
+  // reconciles if we know nothing about prefix yet, otherwise everything would look absent
+  void bootstrap(const std::string& prefix="docs");
+private:
+  FileType store(const std::string& id, const std::string& prefix, const std::string& fname, int64_t size, int64_t mtime);
+  std::vector<std::unordered_map<std::string, MiniSQLite::outvar_t>> query(const std::string& q, const std::initializer_list<SQLiteWriter::var_t>& values);
+  SQLiteWriter& writer();
+  std::unique_ptr<SQLiteWriter> d_sqlw;
+  std::unique_ptr<LockedSqw> d_readers; // instead of d_sqlw if we are read-only
+  std::mutex d_lock;
+};
+
 bool isPresentNonEmpty(const std::string& id, const std::string& prefix="docs", const std::string& suffix="");
 bool isPresentRightSize(const std::string& id, int64_t size, const std::string& prefix="docs");
 bool cacheIsNewer(const std::string& id, const std::string& cacheprefix, const std::string& suffix, const std::string& docprefix);
-bool isPDF(const std::string& fname);
-bool isDocx(const std::string& fname);
-bool isDoc(const std::string& fname);
-bool isRtf(const std::string& fname);
-bool isXML(const std::string& fname);
 uint64_t getRandom64();
 bool endsWith(const std::string& str, const std::string& suffix);
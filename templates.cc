@@ -0,0 +1,90 @@
+#include "templates.hh"
+#include <fmt/format.h>
+#include <cstring>
+#include <filesystem>
+#include <thread>
+#include <sys/inotify.h>
+#include <unistd.h>
+#include "support.hh"
+
+using namespace std;
+
+TemplateRegistry::TemplateRegistry(const std::string& dir) : d_dir(dir)
+{
+  if(!d_dir.empty() && d_dir.back() != '/')
+    d_dir += '/';
+  d_compiled = compile();
+}
+
+shared_ptr<TemplateRegistry::Compiled> TemplateRegistry::compile()
+{
+  auto ret = make_shared<Compiled>();
+  ret->escaped.set_html_autoescape(true);
+  ret->raw.set_html_autoescape(false);
+  
+  for(const auto& f : filesystem::directory_iterator(d_dir)) {
+    string name = f.path().filename();
+    if(!f.is_regular_file() || !endsWith(name, ".html"))
+      continue;
+    ret->escapedTemplates[name] = ret->escaped.parse_template(d_dir + name);
+    ret->rawTemplates[name] = ret->raw.parse_template(d_dir + name);
+  }
+  fmt::print("Parsed {} templates from {}\n", ret->escapedTemplates.size(), d_dir);
+  return ret;
+}
+
+void TemplateRegistry::reload()
+{
+  auto compiled = compile();
+  lock_guard<mutex> l(d_lock);
+  d_compiled = compiled;
+}
+
+string TemplateRegistry::render(const std::string& name, const nlohmann::json& data, bool autoescape)
+{
+  shared_ptr<Compiled> compiled;
+  {
+    lock_guard<mutex> l(d_lock);
+    compiled = d_compiled;
+  }
+  auto& templates = autoescape ? compiled->escapedTemplates : compiled->rawTemplates;
+  auto iter = templates.find(name);
+  if(iter == templates.end())
+    throw runtime_error("No template called '"+name+"' in "+d_dir);
+  return autoescape ? compiled->escaped.render(iter->second, data) : compiled->raw.render(iter->second, data);
+}
+
+void TemplateRegistry::watch()
+{
+  int fd = inotify_init1(IN_CLOEXEC);
+  if(fd < 0)
+    throw runtime_error("Unable to set up inotify: "+string(strerror(errno)));
+  if(inotify_add_watch(fd, d_dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE) < 0) {
+    int e = errno;
+    close(fd);
+    throw runtime_error("Unable to watch "+d_dir+": "+string(strerror(e)));
+  }
+  
+  thread t([this, fd]() {
+    char buffer[4096];
+    for(;;) {
+      if(read(fd, buffer, sizeof(buffer)) <= 0) {
+        if(errno == EINTR)
+          continue;
+        fmt::print("Stopped watching {} for template changes: {}\n", d_dir, strerror(errno));
+        close(fd);
+        return;
+      }
+      // editors tend to write a few times in a row
+      usleep(100000);
+      try {
+        reload();
+      }
+      catch(std::exception& e) {
+        fmt::print("Error reloading templates, keeping previous version: {}\n", e.what());
+      }
+    }
+  });
+  t.detach();
+  fmt::print("Watching {} for template changes\n", d_dir);
+}
@@ -0,0 +1,32 @@
+#pragma once
+#include <string>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include "nlohmann/json.hpp"
+#include "inja.hpp"
+
+// Parses all .html templates in a directory once, so a request only has to render.
+// Call watch() to reparse everything whenever a file in the directory changes, handy during development
+class TemplateRegistry
+{
+public:
+  explicit TemplateRegistry(const std::string& dir);
+  TemplateRegistry(const TemplateRegistry&) = delete;
+  // name is relative to dir, "persoon.html"
+  std::string render(const std::string& name, const nlohmann::json& data, bool autoescape=true);
+  void reload();
+  void watch();
+  
+private:
+  // inja keeps the autoescape setting in the Environment, so we parse everything twice
+  struct Compiled
+  {
+    inja::Environment escaped, raw;
+    std::unordered_map<std::string, inja::Template> escapedTemplates, rawTemplates;
+  };
+  std::shared_ptr<Compiled> compile();
+  std::string d_dir;
+  std::shared_ptr<Compiled> d_compiled;
+  std::mutex d_lock;
+};
@@ -0,0 +1,256 @@
+#define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
+#include <doctest/doctest.h>
+#include <fmt/format.h>
+#include <atomic>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <sys/stat.h>
+#include "httplib.h"
+#include "support.hh"
+
+using namespace std;
+
+// an httplib::Server on a free port of 127.0.0.1, in its own thread for as long as we exist
+struct LocalServer
+{
+  LocalServer()
+  {
+    d_port = svr.bind_to_any_port("127.0.0.1");
+    if(d_port < 0)
+      throw runtime_error("Could not bind a port for the test server");
+    d_thread = thread([this]() { svr.listen_after_bind(); });
+    while(!svr.is_running())
+      this_thread::sleep_for(chrono::milliseconds(1));
+  }
+  ~LocalServer()
+  {
+    svr.stop();
+    d_thread.join();
+  }
+  httplib::Client client()
+  {
+    return httplib::Client("127.0.0.1", d_port);
+  }
+  httplib::Server svr;
+private:
+  int d_port;
+  thread d_thread;
+};
+
+// a fresh directory to download into, gone again when we are
+struct TempDir
+{
+  TempDir()
+  {
+    char tmpl[] = "/tmp/testrunner.XXXXXX";
+    if(!mkdtemp(tmpl))
+      throw runtime_error("Could not make a temporary directory: "+string(strerror(errno)));
+    d_name = tmpl;
+  }
+  ~TempDir()
+  {
+    std::filesystem::remove_all(d_name);
+  }
+  string operator/(const string& fname) const
+  {
+    return d_name + "/" + fname;
+  }
+private:
+  string d_name;
+};
+
+static string readFile(const string& fname)
+{
+  ifstream ifs(fname, ios::binary);
+  stringstream ss;
+  ss << ifs.rdbuf();
+  return ss.str();
+}
+
+static void writeFile(const string& fname, const string& content)
+{
+  ofstream ofs(fname, ios::binary);
+  ofs << content;
+}
+
+static bool exists(const string& fname)
+{
+  struct stat sb;
+  return !stat(fname.c_str(), &sb);
+}
+
+static string makeContent(size_t len)
+{
+  string ret;
+  for(size_t n = 0; n < len; ++n)
+    ret.append(1, 'a' + n % 26);
+  return ret;
+}
+
+TEST_CASE("storeFeedPages with a page without entries") {
+  TempDir dir;
+  SQLiteWriter sqlw(dir/"xml.sqlite3", {}, SQLWFlag::NoTransactions);
+  sqlw.query("create table if not exists Zaak (skiptoken INT)");
+  BoundedQueue<FeedPage> pages(4);
+  // a caught up category, followed by one with news
+  pages.push(FeedPage{"Zaak", {}});
+  FeedPage page{"Zaak", {}};
+  for(int n = 0; n < 3; ++n)
+    page.entries.push_back(FeedEntry{fmt::format("id{}", n), "2024-01-01", "", "<entry/>", {}, 1234});
+  pages.push(std::move(page));
+  pages.push(FeedPage{"Zaak", {}});
+  pages.close();
+
+  std::atomic<bool> failed{false};
+  storeFeedPages(sqlw, pages, 10000, failed);
+  CHECK(!failed);
+  auto rows = sqlw.queryT("select count(1) c from Zaak");
+  CHECK(get<int64_t>(rows[0]["c"]) == 3);
+  // nothing left open
+  sqlw.query("begin");
+  sqlw.query("commit");
+}
+
+TEST_CASE("TokenBucket timing") {
+  TokenBucket tb(20, 2);
+  DTime dt;
+  dt.start();
+  // the burst of 2 is there right away, then 4 more tokens at 20/s. Only lower bounds, a busy box is slow
+  for(int n = 0; n < 6; ++n)
+    tb.take();
+  CHECK(dt.lapUsec() > 180000);
+}
+
+TEST_CASE("TokenBucket shared between threads") {
+  TokenBucket tb(50, 1);
+  DTime dt;
+  dt.start();
+  vector<thread> threads;
+  for(int n = 0; n < 4; ++n)
+    threads.emplace_back([&tb]() {
+      for(int i = 0; i < 5; ++i)
+        tb.take();
+    });
+  for(auto& t : threads)
+    t.join();
+  // 20 tokens, the first one was there already
+  CHECK(dt.lapUsec() > 350000);
+}
+
+TEST_CASE("backoff") {
+  for(int attempt = 1; attempt <= 5; ++attempt) {
+    auto usec = backoffUsec(attempt);
+    uint64_t base = 1000000ULL << (attempt - 1);
+    CHECK(usec >= base);
+    CHECK(usec < base + 500000);
+  }
+}
+
+TEST_CASE("retry on 5xx and 429") {
+  Download d;
+  d.err = httplib::Error::Connection;
+  CHECK(shouldRetry(d));
+
+  LocalServer ls;
+  std::atomic<int> flakycalls{0}, gonecalls{0}, busycalls{0};
+  // busy twice, then the real thing
+  ls.svr.Get("/flaky", [&flakycalls](const httplib::Request& req, httplib::Response& res) {
+    int n = flakycalls++;
+    if(n == 0)
+      res.status = 503;
+    else if(n == 1)
+      res.status = 429;
+    else
+      res.set_content("hello", "text/plain");
+  });
+  ls.svr.Get("/gone", [&gonecalls](const httplib::Request& req, httplib::Response& res) {
+    gonecalls++;
+    res.status = 404;
+  });
+  ls.svr.Get("/busy", [&busycalls](const httplib::Request& req, httplib::Response& res) {
+    busycalls++;
+    res.status = 500;
+  });
+
+  TempDir dir;
+  auto cli = ls.client();
+  TokenBucket tb(1000, 10);
+  std::atomic<uint64_t> bytes{0};
+  vector<uint64_t> sleeps;
+  auto sleep = [&sleeps](uint64_t usec) { sleeps.push_back(usec); };
+
+  CHECK(retrieveFile(cli, "/flaky", dir/"flaky", 5, tb, bytes, 5, sleep));
+  CHECK(flakycalls == 3);
+  CHECK(readFile(dir/"flaky") == "hello");
+  CHECK(!exists(dir/"flaky.tmp"));
+  CHECK(bytes == 5);
+  // and it backed off in between, longer the second time
+  REQUIRE(sleeps.size() == 2);
+  CHECK(sleeps[0] >= 1000000);
+  CHECK(sleeps[1] >= 2000000);
+
+  // final, no retries
+  sleeps.clear();
+  CHECK(!retrieveFile(cli, "/gone", dir/"gone", 0, tb, bytes, 5, sleep));
+  CHECK(gonecalls == 1);
+  CHECK(sleeps.empty());
+  CHECK(!exists(dir/"gone"));
+
+  // gives up after maxretries
+  sleeps.clear();
+  CHECK(!retrieveFile(cli, "/busy", dir/"busy", 0, tb, bytes, 3, sleep));
+  CHECK(busycalls == 4);
+  CHECK(sleeps.size() == 3);
+  CHECK(!exists(dir/"busy"));
+}
+
+TEST_CASE("downloadFile resumes with a Range request") {
+  LocalServer ls;
+  string content = makeContent(100000);
+  string range;
+  ls.svr.Get("/doc", [&content, &range](const httplib::Request& req, httplib::Response& res) {
+    range = req.get_header_value("Range");
+    res.set_content(content, "application/pdf"); // httplib does the Range for us
+  });
+
+  TempDir dir;
+  string fname = dir/"doc";
+  writeFile(fname+".tmp", content.substr(0, 30000));
+
+  auto cli = ls.client();
+  auto d = downloadFile(cli, "/doc", fname, content.size());
+  CHECK(range == "bytes=30000-");
+  CHECK(d.status == 206);
+  CHECK(d.bytes == 70000);
+  CHECK(d.size == content.size());
+  CHECK(d.complete);
+  CHECK(readFile(fname) == content);
+  CHECK(!exists(fname+".tmp"));
+
+  // nothing left over, so no Range this time
+  d = downloadFile(cli, "/doc", dir/"doc2", content.size());
+  CHECK(range.empty());
+  CHECK(d.status == 200);
+  CHECK(d.bytes == content.size());
+  CHECK(readFile(dir/"doc2") == content);
+}
+
+TEST_CASE("downloadFile drops a .tmp the server won't resume") {
+  LocalServer ls;
+  ls.svr.Get("/doc", [](const httplib::Request& req, httplib::Response& res) {
+    res.status = 416;
+  });
+
+  TempDir dir;
+  string fname = dir/"doc";
+  writeFile(fname+".tmp", "partial");
+
+  auto cli = ls.client();
+  auto d = downloadFile(cli, "/doc", fname, 1000);
+  CHECK(d.status == 416);
+  CHECK(!d.complete);
+  CHECK(!exists(fname+".tmp"));
+  CHECK(!exists(fname));
+}
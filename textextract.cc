@@ -0,0 +1,518 @@
+#include "textextract.hh"
+#include <stdexcept>
+#include <memory>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include <cstring>
+#include <zlib.h>
+#include <zstd.h>
+#include "pugixml.hpp"
+
+using namespace std;
+
+static string readFile(const std::string& fname)
+{
+  FILE* pfp = fopen(fname.c_str(), "r");
+  if(!pfp)
+    throw runtime_error("Unable to open "+fname+": "+string(strerror(errno)));
+  shared_ptr<FILE> fp(pfp, fclose);
+  string ret;
+  char buffer[65536];
+  while(size_t len = fread(buffer, 1, sizeof(buffer), fp.get()))
+    ret.append(buffer, len);
+  if(ferror(fp.get()))
+    throw runtime_error("Unable to read "+fname+": "+string(strerror(errno)));
+  return ret;
+}
+
+string textFromFileExternal(const std::string& fname, FileType type)
+{
+  string command;
+  switch(type) {
+  case FileType::PDF:
+    command = string("pdftotext -q -nopgbrk - < '") + fname + "' -";
+    break;
+  case FileType::Docx:
+    command = string("pandoc -f docx '"+fname+"' -t plain");
+    break;
+  case FileType::XML:
+    command = string("xmlstarlet tr tk.xslt < '"+fname+"' | sed 's:<[^>]*>: :g'");
+    break;
+  case FileType::Doc:
+    command = "catdoc - < '" + fname +"'";
+    break;
+  case FileType::Rtf:
+    command = string("pandoc -f rtf '"+fname+"' -t plain");
+    break;
+  case FileType::Unknown:
+    return "";
+  }
+
+  string ret;
+  FILE* pfp = popen(command.c_str(), "r");
+  if(!pfp)
+    throw runtime_error("Unable to perform pdftotext: "+string(strerror(errno)));
+  shared_ptr<FILE> fp(pfp, pclose);
+
+  char buffer[4096];
+
+  for(;;) {
+    int len = fread(buffer, 1, sizeof(buffer), fp.get());
+    if(!len)
+      break;
+    ret.append(buffer, len);
+  }
+  if(ferror(fp.get()))
+    throw runtime_error("Unable to perform pdftotext: "+string(strerror(errno)));
+  return ret;
+}
+
+string textFromFile(const std::string& fname, FileType type)
+{
+  switch(type) {
+  case FileType::XML:
+    return textFromVerslagXML(readFile(fname));
+  case FileType::Docx:
+    return textFromZippedDocument(readFile(fname));
+  default:
+    return textFromFileExternal(fname, type);
+  }
+}
+
+// the vergaderverslag elements are in a namespace, sometimes with a prefix
+static string_view localName(const pugi::xml_node& node)
+{
+  string_view name = node.name();
+  if(auto pos = name.find(':'); pos != string_view::npos)
+    name.remove_prefix(pos + 1);
+  return name;
+}
+
+// like the xslt built-in rule: all text below node
+static void allText(const pugi::xml_node& node, string& out)
+{
+  for(auto child : node.children()) {
+    if(child.type() == pugi::node_pcdata || child.type() == pugi::node_cdata) {
+      out.append(child.value());
+      out.append(1, ' '); // sed turned every tag into a space
+    }
+    else if(child.type() == pugi::node_element)
+      allText(child, out);
+  }
+}
+
+// which children the templates in tk.xslt descend into, anything not in here gets all its text.
+// "*" is every element, but not the text directly below it
+static const unordered_map<string_view, vector<string_view>> g_verslagSelects = {
+  {"vergadering", {"titel", "activiteit"}},
+  {"activiteit", {"activiteithoofd"}},
+  {"activiteithoofd", {"titel", "tekst", "activiteitdeel"}},
+  {"tekst", {"*"}},
+  {"activiteitdeel", {"tekst", "activiteititem"}},
+  {"activiteititem", {"tekst", "woordvoerder"}},
+  {"woordvoerder", {"tekst", "interrumpant"}},
+  {"interrumpant", {"tekst"}},
+  {"alinea", {"*"}}
+};
+
+static void verslagText(const pugi::xml_node& node, string& out)
+{
+  auto iter = g_verslagSelects.find(localName(node));
+  if(iter == g_verslagSelects.end()) {
+    allText(node, out);
+    return;
+  }
+  for(auto child : node.children()) {
+    if(child.type() != pugi::node_element)
+      continue;
+    auto name = localName(child);
+    for(const auto& sel : iter->second) {
+      if(sel == "*" || sel == name) {
+        verslagText(child, out);
+        break;
+      }
+    }
+  }
+}
+
+string textFromVerslagXML(const std::string& xml)
+{
+  pugi::xml_document doc;
+  if(!doc.load_buffer(xml.c_str(), xml.size()))
+    throw runtime_error("Could not parse verslag XML");
+  auto root = doc.document_element();
+  string ret;
+  // the <title>
+  for(auto child : root.children()) {
+    if(child.type() != pugi::node_element)
+      continue;
+    if(localName(child) == "vergadering") {
+      string soort = child.attribute("soort").value();
+      ret += soort == "Commissie" ? "Commissievergadering" : (soort == "Plenair" ? "Plenaire vergadering" : "Vergadering");
+      ret += "; ";
+      for(auto titel : child.children()) {
+        if(localName(titel) == "titel") {
+          allText(titel, ret);
+          break;
+        }
+      }
+    }
+    else
+      allText(child, ret);
+  }
+  ret.append(1, '\n');
+  // and the <body>
+  for(auto child : root.children())
+    if(child.type() == pugi::node_element)
+      verslagText(child, ret);
+  return ret;
+}
+
+static void docxText(const pugi::xml_node& node, string& out)
+{
+  for(auto child : node.children()) {
+    if(child.type() != pugi::node_element)
+      continue;
+    string_view name = child.name();
+    if(name == "w:t")
+      out.append(child.text().get());
+    else if(name == "w:tab")
+      out.append(1, '\t');
+    else if(name == "w:br" || name == "w:cr")
+      out.append(1, '\n');
+    else if(name != "w:delText" && name != "w:instrText") { // deleted text and field codes
+      docxText(child, out);
+      if(name == "w:p")
+        out.append(1, '\n');
+    }
+  }
+}
+
+static void odtText(const pugi::xml_node& node, string& out)
+{
+  for(auto child : node.children()) {
+    if(child.type() == pugi::node_pcdata) {
+      out.append(child.value());
+      continue;
+    }
+    if(child.type() != pugi::node_element)
+      continue;
+    string_view name = child.name();
+    if(name == "text:s")
+      out.append(max(1, child.attribute("text:c").as_int()), ' ');
+    else if(name == "text:tab")
+      out.append(1, '\t');
+    else if(name == "text:line-break")
+      out.append(1, '\n');
+    else {
+      odtText(child, out);
+      if(name == "text:p" || name == "text:h")
+        out.append(1, '\n');
+    }
+  }
+}
+
+string textFromZippedDocument(const std::string& zip)
+{
+  string xml, ret;
+  // whitespace between elements is content here
+  auto parse = [&xml](pugi::xml_document& doc, const std::string& name) {
+    if(!doc.load_buffer_inplace(xml.data(), xml.size(), pugi::parse_default | pugi::parse_ws_pcdata))
+      throw runtime_error("Could not parse "+name+" from zip file");
+  };
+  if(getZipMember(zip, "word/document.xml", xml)) {
+    pugi::xml_document doc;
+    parse(doc, "word/document.xml");
+    docxText(doc, ret);
+    for(string name : {"word/footnotes.xml", "word/endnotes.xml"}) {
+      if(getZipMember(zip, name, xml)) {
+        pugi::xml_document notes;
+        parse(notes, name);
+        docxText(notes, ret);
+      }
+    }
+  }
+  else if(getZipMember(zip, "content.xml", xml)) {
+    pugi::xml_document doc;
+    parse(doc, "content.xml");
+    odtText(doc.document_element().child("office:body"), ret);
+  }
+  return ret;
+}
+
+static uint32_t getLE(const std::string& s, size_t pos, int bytes)
+{
+  if(pos + bytes > s.size())
+    throw runtime_error("Truncated zip file");
+  uint32_t ret = 0;
+  for(int n = bytes - 1; n >= 0; --n)
+    ret = (ret << 8) | (uint8_t)s[pos + n];
+  return ret;
+}
+
+// no zip64 and no encryption, neither of which we have seen in office documents
+bool getZipMember(const std::string& zip, const std::string& name, std::string& out)
+{
+  // the end of central directory record is at the very end, followed by a comment of at most 64k
+  if(zip.size() < 22)
+    throw runtime_error("Too short for a zip file");
+  size_t eocd = string::npos;
+  for(size_t pos = zip.size() - 22; zip.size() - pos <= 22 + 65535; --pos) {
+    if(getLE(zip, pos, 4) == 0x06054b50) {
+      eocd = pos;
+      break;
+    }
+    if(!pos)
+      break;
+  }
+  if(eocd == string::npos)
+    throw runtime_error("No central directory in zip file");
+
+  unsigned int entries = getLE(zip, eocd + 10, 2);
+  size_t pos = getLE(zip, eocd + 16, 4);
+  for(unsigned int n = 0; n < entries; ++n) {
+    if(getLE(zip, pos, 4) != 0x02014b50)
+      throw runtime_error("Bad central directory entry in zip file");
+    unsigned int method = getLE(zip, pos + 10, 2);
+    size_t csize = getLE(zip, pos + 20, 4), usize = getLE(zip, pos + 24, 4);
+    size_t namelen = getLE(zip, pos + 28, 2), extralen = getLE(zip, pos + 30, 2), commentlen = getLE(zip, pos + 32, 2);
+    size_t offset = getLE(zip, pos + 42, 4);
+    if(pos + 46 + namelen > zip.size())
+      throw runtime_error("Truncated zip file");
+    bool match = !zip.compare(pos + 46, namelen, name);
+    pos += 46 + namelen + extralen + commentlen;
+    if(!match)
+      continue;
+
+    if(getLE(zip, offset, 4) != 0x04034b50)
+      throw runtime_error("Bad local header for "+name+" in zip file");
+    // the local header can have a different extra field than the central directory
+    size_t data = offset + 30 + getLE(zip, offset + 26, 2) + getLE(zip, offset + 28, 2);
+    if(data + csize > zip.size())
+      throw runtime_error("Truncated zip file");
+    if(method == 0) {
+      out.assign(zip, data, csize);
+      return true;
+    }
+    if(method != 8)
+      throw runtime_error("Unsupported compression method "+to_string(method)+" for "+name+" in zip file");
+    if(usize > 1024*1024*1024)
+      throw runtime_error(name+" in zip file is too large");
+
+    out.resize(usize);
+    z_stream zs{};
+    zs.next_in = (Bytef*)(zip.data() + data);
+    zs.avail_in = csize;
+    zs.next_out = (Bytef*)out.data();
+    zs.avail_out = usize;
+    if(inflateInit2(&zs, -MAX_WBITS) != Z_OK) // raw deflate, no zlib header
+      throw runtime_error("Could not initialize zlib");
+    int ret = inflate(&zs, Z_FINISH);
+    inflateEnd(&zs);
+    if(ret != Z_STREAM_END)
+      throw runtime_error("Could not inflate "+name+" from zip file");
+    out.resize(zs.total_out);
+    return true;
+  }
+  return false;
+}
+
+TextCache::TextCache(const std::string& fname, unsigned int readers, bool readonly)
+{
+  d_readers = make_unique<LockedSqw>(fname, readers);
+  if(readonly)
+    return;
+  setWALMode(fname); // readers don't block on the writer
+  d_sqlw = make_unique<SQLiteWriter>(fname, std::initializer_list<std::pair<std::string_view, std::string_view>>{}, SQLWFlag::NoTransactions);
+  d_sqlw->query("create table if not exists texts (id TEXT, hash TEXT, text BLOB)");
+  d_sqlw->query("create unique index if not exists textsidx on texts(id, hash)");
+}
+
+SQLiteWriter& TextCache::writer()
+{
+  if(!d_sqlw)
+    throw runtime_error("Can't change a read-only text cache");
+  return *d_sqlw;
+}
+
+std::optional<string> TextCache::get(const std::string& id, const std::string& hash)
+{
+  auto rows = d_readers->query("select text from texts where id=? and hash=?", {id, hash});
+  if(rows.empty())
+    return std::nullopt;
+  return decompress(id, std::get<vector<uint8_t>>(rows[0]["text"]));
+}
+
+std::optional<string> TextCache::get(const std::string& id)
+{
+  auto rows = d_readers->query("select text from texts where id=? order by rowid desc limit 1", {id});
+  if(rows.empty())
+    return std::nullopt;
+  return decompress(id, std::get<vector<uint8_t>>(rows[0]["text"]));
+}
+
+std::optional<string> TextCache::getPrefix(const std::string& id, size_t maxbytes)
+{
+  auto rows = d_readers->query("select text from texts where id=? order by rowid desc limit 1", {id});
+  if(rows.empty())
+    return std::nullopt;
+  const auto& blob = std::get<vector<uint8_t>>(rows[0]["text"]);
+  unique_ptr<ZSTD_DStream, decltype(&ZSTD_freeDStream)> ds(ZSTD_createDStream(), &ZSTD_freeDStream);
+  if(!ds)
+    throw runtime_error("Could not create zstd stream");
+  string ret(maxbytes, '\0');
+  ZSTD_inBuffer in{blob.data(), blob.size(), 0};
+  ZSTD_outBuffer out{ret.data(), ret.size(), 0};
+  // stops once the output is full, the rest of the frame we never look at
+  while(out.pos < out.size && in.pos < in.size) {
+    size_t res = ZSTD_decompressStream(ds.get(), &out, &in);
+    if(ZSTD_isError(res))
+      throw runtime_error(string("Could not decompress cached text: ")+ZSTD_getErrorName(res));
+    if(!res)
+      break;
+  }
+  ret.resize(out.pos);
+  if(ret.size() == maxbytes) {
+    // back up to the start of the last character, and drop it if it got cut off
+    size_t pos = ret.size();
+    while(pos > 0 && ((unsigned char)ret[pos-1] & 0xc0) == 0x80)
+      pos--;
+    if(pos > 0 && ((unsigned char)ret[pos-1] & 0x80)) {
+      unsigned char lead = ret[pos-1];
+      size_t len = (lead & 0xe0) == 0xc0 ? 2 : (lead & 0xf0) == 0xe0 ? 3 : 4;
+      if(ret.size() - (pos - 1) < len)
+        ret.resize(pos - 1);
+    }
+  }
+  return ret;
+}
+
+string TextCache::decompress(const std::string& id, const std::vector<uint8_t>& blob)
+{
+  auto len = ZSTD_getFrameContentSize(blob.data(), blob.size());
+  if(len == ZSTD_CONTENTSIZE_ERROR || len == ZSTD_CONTENTSIZE_UNKNOWN)
+    throw runtime_error("Cached text for "+id+" is not a zstd frame");
+  string ret(len, '\0');
+  size_t res = ZSTD_decompress(ret.data(), ret.size(), blob.data(), blob.size());
+  if(ZSTD_isError(res))
+    throw runtime_error(string("Could not decompress cached text: ")+ZSTD_getErrorName(res));
+  ret.resize(res);
+  return ret;
+}
+
+void TextCache::put(const std::string& id, const std::string& hash, const std::string& text)
+{
+  vector<uint8_t> blob(ZSTD_compressBound(text.size()));
+  size_t res = ZSTD_compress(blob.data(), blob.size(), text.c_str(), text.size(), 3);
+  if(ZSTD_isError(res))
+    throw runtime_error(string("Could not compress text: ")+ZSTD_getErrorName(res));
+  blob.resize(res);
+  writer().addOrReplaceValue({{"id", id}, {"hash", hash}, {"text", blob}}, "texts");
+}
+
+void TextCache::prune(const std::string& id, const std::string& hash)
+{
+  writer().queryT("delete from texts where id=? and hash!=?", {id, hash});
+}
+
+void TextCache::begin()
+{
+  writer().query("begin");
+}
+
+void TextCache::commit()
+{
+  writer().query("commit");
+}
+
+void TextCache::rollback()
+{
+  writer().query("rollback");
+}
+
+// what the unicode61 tokenizer with tokenchars '_' sees as part of a word, more or less.
+// Everything non-ASCII counts, so UTF-8 stays in one piece
+static bool isTokenChar(char c)
+{
+  return (unsigned char)c >= 0x80 || isalnum((unsigned char)c) || c == '_';
+}
+
+static string asciiLower(string_view in)
+{
+  string ret(in);
+  for(auto& c : ret)
+    c = tolower((unsigned char)c);
+  return ret;
+}
+
+std::string makeSnippet(const std::string& text, const std::string& query, unsigned int tokens, size_t maxscan)
+{
+  // the terms, minus operators. A trailing * makes it a prefix
+  vector<pair<string, bool>> terms;
+  for(size_t pos = 0; pos < query.size();) {
+    if(!isTokenChar(query[pos])) {
+      pos++;
+      continue;
+    }
+    size_t end = pos;
+    while(end < query.size() && isTokenChar(query[end]))
+      end++;
+    string_view word(query.c_str() + pos, end - pos);
+    bool prefix = end < query.size() && query[end] == '*';
+    if(word != "AND" && word != "OR" && word != "NOT" && word != "NEAR")
+      terms.push_back({asciiLower(word), prefix});
+    pos = end;
+  }
+
+  vector<pair<size_t, size_t>> toks; // begin, end in text
+  vector<bool> hits;
+  for(size_t pos = 0; pos < min(text.size(), maxscan);) {
+    if(!isTokenChar(text[pos])) {
+      pos++;
+      continue;
+    }
+    size_t end = pos;
+    while(end < text.size() && isTokenChar(text[end]))
+      end++;
+    string word = asciiLower(string_view(text.c_str() + pos, end - pos));
+    bool hit = false;
+    for(const auto& t : terms) {
+      if(t.second ? !word.compare(0, t.first.size(), t.first) : word == t.first) {
+        hit = true;
+        break;
+      }
+    }
+    toks.push_back({pos, end});
+    hits.push_back(hit);
+    pos = end;
+  }
+  if(toks.empty())
+    return "";
+
+  // the window with the most hits, the first one if there is a tie
+  size_t n = min((size_t)tokens, toks.size()), best = 0;
+  unsigned int count = 0, bestcount = 0;
+  for(size_t i = 0; i < toks.size(); ++i) {
+    count += hits[i];
+    if(i >= n)
+      count -= hits[i - n];
+    if(i + 1 >= n && count > bestcount) {
+      bestcount = count;
+      best = i + 1 - n;
+    }
+  }
+
+  string ret = best ? "..." : "";
+  for(size_t i = best; i < best + n; ++i) {
+    if(i > best)
+      ret.append(text, toks[i-1].second, toks[i].first - toks[i-1].second);
+    if(hits[i])
+      ret += "<b>" + text.substr(toks[i].first, toks[i].second - toks[i].first) + "</b>";
+    else
+      ret.append(text, toks[i].first, toks[i].second - toks[i].first);
+  }
+  if(best + n < toks.size() || text.size() > maxscan)
+    ret += "...";
+  return ret;
+}
@@ -0,0 +1,52 @@
+#pragma once
+#include <string>
+#include <optional>
+#include "support.hh"
+
+/* Gets the plain text out of enclosures for the search index. Vergaderverslag XML, DOCX and ODT
+   we do in-process, for PDF, DOC and RTF we still run pdftotext, catdoc and pandoc.
+   These functions are all thread safe */
+
+// in-process where we can, returns "" for types we can't deal with
+std::string textFromFile(const std::string& fname, FileType type);
+// always through an external tool, which is how tkindex used to do every document
+std::string textFromFileExternal(const std::string& fname, FileType type);
+
+// the text tk.xslt would produce for a vergaderverslag, minus the tags
+std::string textFromVerslagXML(const std::string& xml);
+// DOCX and ODT are both zip files, this looks for word/document.xml or content.xml
+std::string textFromZippedDocument(const std::string& zip);
+// returns false if there is no member with that name, throws if the zip file is broken
+bool getZipMember(const std::string& zip, const std::string& name, std::string& out);
+
+/* Extracted text, zstd compressed, in its own database so it survives rebuilding the index.
+   Keyed on document id and the hash of the enclosure from the manifest, so a changed enclosure
+   never gets the old text. get() is thread safe, put() and the transactions belong to one writer.
+   A readonly cache, for tkserv, never writes, not even the schema */
+class TextCache
+{
+public:
+  explicit TextCache(const std::string& fname = "textcache.sqlite3", unsigned int readers = 4, bool readonly = false);
+  std::optional<std::string> get(const std::string& id, const std::string& hash);
+  // whatever version we have for id, good enough for a snippet
+  std::optional<std::string> get(const std::string& id);
+  // the first maxbytes of that, without decompressing the rest. Never ends halfway a UTF-8 character
+  std::optional<std::string> getPrefix(const std::string& id, size_t maxbytes);
+  void put(const std::string& id, const std::string& hash, const std::string& text);
+  // removes the other versions of id, once nothing refers to them anymore
+  void prune(const std::string& id, const std::string& hash);
+  void begin();
+  void commit();
+  void rollback();
+private:
+  std::string decompress(const std::string& id, const std::vector<uint8_t>& blob);
+  SQLiteWriter& writer();
+  std::unique_ptr<SQLiteWriter> d_sqlw;
+  std::unique_ptr<LockedSqw> d_readers;
+};
+
+// like FTS5 snippet(docsearch, -1, '<b>', '</b>', '...', tokens), for a contentless index that has no text to
+// make one from. Understands enough of the match syntax to find the terms, prefix* included
+// Only looks at the first maxscan bytes, a verslag can have megabytes of text and a search wants hundreds of snippets
+constexpr size_t g_snippetscan = 65536;
+std::string makeSnippet(const std::string& text, const std::string& query, unsigned int tokens = 20, size_t maxscan = g_snippetscan);
@@ -0,0 +1,272 @@
+#include <fmt/format.h>
+#include <fmt/printf.h>
+#include <iostream>
+#include <atomic>
+#include <thread>
+#include <random>
+#include "sqlwriter.hh"
+#include "support.hh"
+#include "pugixml.hpp"
+#include "xmlcompress.hh"
+#include "textextract.hh"
+#include <filesystem>
+
+using namespace std;
+
+// hammers tk.sqlite3 with the kind of lookups /document.html does, from 1 up to maxthreads threads
+// the 'serial' column uses a single connection, which is how tkserv used to work
+static void benchPool(unsigned int maxthreads, int seconds)
+{
+  SQLiteWriter sqlw("tk.sqlite3");
+  auto rows = sqlw.queryT("select nummer from Document order by rowid desc limit 20000");
+  if(rows.empty())
+    throw runtime_error("No documents in tk.sqlite3 to benchmark with");
+  vector<string> nummers;
+  for(auto& r : rows)
+    nummers.push_back(get<string>(r["nummer"]));
+
+  auto run = [&](LockedSqw& pool, unsigned int numthreads) {
+    atomic<bool> stop = false;
+    atomic<uint64_t> queries = 0;
+    vector<thread> workers;
+    for(unsigned int n = 0; n < numthreads; ++n) {
+      workers.emplace_back([&, n]() {
+        std::mt19937 gen(n);
+        std::uniform_int_distribution<size_t> dist(0, nummers.size()-1);
+        while(!stop) {
+          auto ret = pool.query("select Document.*, DocumentVersie.externeidentifier, DocumentVersie.versienummer from Document,DocumentVersie where nummer=? and document.id=documentversie.documentid limit 1", {nummers[dist(gen)]});
+          if(!ret.empty())
+            pool.query("select distinct(naar) as naar, zaak.nummer znummer from Link,Zaak where van=? and naar=zaak.id and category='Document' and linkSoort='Zaak'", {get<string>(ret[0]["id"])});
+          queries++;
+        }
+      });
+    }
+    this_thread::sleep_for(chrono::seconds(seconds));
+    stop = true;
+    for(auto& w : workers)
+      w.join();
+    return 1.0*queries / seconds;
+  };
+
+  fmt::print("{:>8} {:>12} {:>12}\n", "threads", "serial q/s", "pooled q/s");
+  for(unsigned int numthreads = 1; numthreads <= maxthreads; numthreads *= 2) {
+    LockedSqw serial("tk.sqlite3", 1);
+    LockedSqw pooled("tk.sqlite3", numthreads);
+    double s = run(serial, numthreads);
+    double p = run(pooled, numthreads);
+    fmt::print("{:>8} {:>12.0f} {:>12.0f}\n", numthreads, s, p);
+  }
+}
+
+// compares the old way of searching (open tkindex.sqlite3, attach, create table for every query)
+// with a pooled connection that keeps its attachments and prepared statements
+static void benchSearch(const vector<string>& terms, int rounds)
+{
+  string q1 = "SELECT uuid, snippet(docsearch,-1, '<b>', '</b>', '...', 20) as snip, bm25(docsearch) as score, category FROM docsearch WHERE docsearch match ? and datum > ? order by score limit 280";
+  auto q2 = [](const string& schema) {
+    return "select uuid,meta.Document.onderwerp, meta.Document.bijgewerkt, meta.Document.titel, nummer, datum, snip, score FROM "+schema+"uuids,meta.Document where "+schema+"uuids.uuid=Document.id";
+  };
+  
+  DTime dt;
+  dt.start();
+  for(int r = 0; r < rounds; ++r) {
+    for(const auto& term : terms) {
+      SQLiteWriter idx("tkindex.sqlite3");
+      idx.query("ATTACH DATABASE 'tk.sqlite3' as meta");
+      idx.query("ATTACH DATABASE ':memory:' as tmp");
+      idx.queryT("create table tmp.uuids as "+q1, {term, ""});
+      idx.queryT(q2("tmp."));
+    }
+  }
+  double before = dt.lapUsec() / 1000.0 / (rounds * terms.size());
+
+  LockedSqw idxsqw("tkindex.sqlite3", 1, {"ATTACH DATABASE 'tk.sqlite3' as meta",
+                    "create temp table uuids (uuid TEXT, snip TEXT, score REAL, category TEXT)"});
+  dt.start();
+  for(int r = 0; r < rounds; ++r) {
+    for(const auto& term : terms) {
+      auto idx = idxsqw.getConnection();
+      idx->queryT("delete from temp.uuids");
+      idx->queryT("insert into temp.uuids "+q1, {term, ""});
+      idx->queryT(q2("temp."));
+    }
+  }
+  double after = dt.lapUsec() / 1000.0 / (rounds * terms.size());
+  fmt::print("Per query: {:.2f} msec opening & attaching every time, {:.2f} msec with a pooled connection\n",
+             before, after);
+}
+
+// copies the newest entries of a category from xml.sqlite3 into a plain and a zstd compressed database,
+// and compares their size and how long a full scan like tkconv does takes
+static void benchXMLZ(const string& category, int limit)
+{
+  vector<string> xmls;
+  {
+    SQLiteWriter xmlstore("xml.sqlite3");
+    XMLCompressor xc(xmlstore);
+    auto rows = xmlstore.queryT("select xml from "+category+" order by rowid desc limit ?", {limit});
+    for(auto& r : rows)
+      xmls.push_back(xc.getXML(r["xml"]));
+  }
+  if(xmls.size() < 100)
+    throw runtime_error("Not enough "+category+" entries in xml.sqlite3 to benchmark with");
+
+  DTime dt;
+  dt.start();
+  vector<string> samples(xmls.begin(), xmls.begin() + min(xmls.size(), (size_t)10000));
+  auto dict = XMLCompressor::trainDict(samples);
+  fmt::print("Trained {} byte dictionary on {} entries in {:.1f} msec\n", dict.size(), samples.size(), dt.lapUsec()/1000.0);
+
+  for(bool compressed : {false, true}) {
+    string fname = compressed ? "tkbench-zstd.sqlite3" : "tkbench-plain.sqlite3";
+    unlink(fname.c_str());
+    {
+      SQLiteWriter sqlw(fname);
+      XMLCompressor xc(sqlw);
+      if(compressed)
+        xc.addDict(category, dict);
+      for(const auto& x : xmls) {
+        if(compressed)
+          sqlw.addValue({{"xml", xc.compress(category, x)}}, category);
+        else
+          sqlw.addValue({{"xml", x}}, category);
+      }
+    }
+    auto size = filesystem::file_size(fname);
+
+    SQLiteWriter sqlw(fname);
+    XMLCompressor xc(sqlw);
+    if(compressed)
+      xc.addDict(category, dict);
+    dt.start();
+    size_t bytes = 0;
+    for(auto& r : sqlw.queryT("select * from "+category)) {
+      pugi::xml_document doc;
+      string xml = xc.getXML(r["xml"]);
+      if(!doc.load_string(xml.c_str()))
+        throw runtime_error("Could not parse XML");
+      bytes += xml.size();
+    }
+    double msec = dt.lapUsec()/1000.0;
+    fmt::print("{:>6}: {:>12} bytes on disk, full scan of {} entries ({} bytes of XML) in {:.1f} msec\n",
+               compressed ? "zstd" : "plain", size, xmls.size(), bytes, msec);
+    unlink(fname.c_str());
+  }
+}
+
+// text extraction for the search index, in-process versus the pdftotext/pandoc/xmlstarlet way,
+// on up to 'count' enclosures of every type we handle in-process
+static void benchExtract(size_t count)
+{
+  EnclosureManifest manifest;
+  map<FileType, vector<string>> bytype;
+  for(const auto& e : manifest.getAll("docs")) {
+    auto& ids = bytype[e.second.type];
+    if(ids.size() < count)
+      ids.push_back(e.first);
+  }
+
+  fmt::print("{:>6} {:>6} {:>14} {:>14}\n", "type", "docs", "popen docs/s", "in-proc docs/s");
+  for(auto type : {FileType::XML, FileType::Docx}) {
+    const auto& ids = bytype[type];
+    if(ids.empty())
+      continue;
+    double rates[2];
+    size_t chars[2] = {0, 0};
+    for(int inproc = 0; inproc < 2; ++inproc) {
+      DTime dt;
+      dt.start();
+      for(const auto& id : ids) {
+        string fname = makePathForId(id);
+        chars[inproc] += (inproc ? textFromFile(fname, type) : textFromFileExternal(fname, type)).size();
+      }
+      rates[inproc] = ids.size() * 1000000.0 / max((uint64_t)1, dt.lapUsec());
+    }
+    fmt::print("{:>6} {:>6} {:>14.1f} {:>14.1f}   ({} vs {} characters of text)\n", fileTypeName(type), ids.size(),
+               rates[0], rates[1], chars[0], chars[1]);
+  }
+}
+
+// size on disk and search latency, snippets included, of a regular and a contentless index
+// (tkindex --contentless). The contentless one gets its snippets from the text cache, like tkserv does
+static void benchFTS(const vector<string>& fnames, const vector<string>& terms, int rounds)
+{
+  unique_ptr<TextCache> textcache;
+  fmt::print("{:>24} {:>12} {:>12} {:>14}\n", "index", "MB", "matches", "msec/query");
+  for(const auto& fname : fnames) {
+    SQLiteReader idx(fname);
+    auto ret = idx.queryT("select sql from sqlite_master where name='docsearch'");
+    if(ret.empty())
+      throw runtime_error("No docsearch table in "+fname);
+    bool contentless = get<string>(ret[0]["sql"]).find("content=''") != string::npos;
+    if(contentless && !textcache)
+      textcache = make_unique<TextCache>("textcache.sqlite3", 4, true);
+    string q = contentless ?
+      "SELECT uuid, bm25(docsearch) as score FROM docsearch, indexed WHERE indexed.id = docsearch.rowid and docsearch match ? order by score limit 280" :
+      "SELECT uuid, snippet(docsearch,-1, '<b>', '</b>', '...', 20) as snip, bm25(docsearch) as score FROM docsearch WHERE docsearch match ? order by score limit 280";
+
+    size_t matches = 0;
+    DTime dt;
+    dt.start();
+    for(int r = 0; r < rounds; ++r) {
+      for(const auto& term : terms) {
+        auto rows = idx.queryT(q, {term});
+        if(contentless) {
+          for(auto& row : rows)
+            if(auto text = textcache->getPrefix(get<string>(row["uuid"]), g_snippetscan))
+              row["snip"] = makeSnippet(*text, term);
+        }
+        matches += rows.size();
+      }
+    }
+    double msec = dt.lapUsec() / 1000.0 / (rounds * terms.size());
+    fmt::print("{:>24} {:>12.1f} {:>12} {:>14.2f}{}\n", fname, filesystem::file_size(fname) / 1000000.0,
+               matches / rounds, msec, contentless ? " (contentless)" : "");
+  }
+}
+
+int main(int argc, char** argv)
+{
+  if(argc < 2) {
+    fmt::print("Syntax: tkbench pool [maxthreads] [seconds]\n");
+    fmt::print("        tkbench search [term...]\n");
+    fmt::print("        tkbench xmlz [category] [entries]\n");
+    fmt::print("        tkbench extract [docs]\n");
+    fmt::print("        tkbench fts [index...]\n");
+    return EXIT_FAILURE;
+  }
+  string mode = argv[1];
+  if(mode == "pool") {
+    unsigned int maxthreads = argc > 2 ? atoi(argv[2]) : 2*thread::hardware_concurrency();
+    int seconds = argc > 3 ? atoi(argv[3]) : 5;
+    benchPool(maxthreads, seconds);
+  }
+  else if(mode == "search") {
+    vector<string> terms;
+    for(int n = 2; n < argc; ++n)
+      terms.push_back(argv[n]);
+    if(terms.empty())
+      terms = {"stikstof", "defensie", "\"F-35\"", "NEAR(woningbouw starters)", "toeslagen"};
+    benchSearch(terms, 10);
+  }
+  else if(mode == "xmlz") {
+    string category = argc > 2 ? argv[2] : "Document";
+    int limit = argc > 3 ? atoi(argv[3]) : 100000;
+    benchXMLZ(category, limit);
+  }
+  else if(mode == "extract") {
+    benchExtract(argc > 2 ? atoi(argv[2]) : 200);
+  }
+  else if(mode == "fts") {
+    vector<string> fnames;
+    for(int n = 2; n < argc; ++n)
+      fnames.push_back(argv[n]);
+    if(fnames.empty())
+      fnames = {"tkindex.sqlite3", "tkindex-contentless.sqlite3"};
+    benchFTS(fnames, {"stikstof", "defensie", "\"F-35\"", "NEAR(woningbouw starters)", "toeslagen"}, 10);
+  }
+  else {
+    fmt::print("Unknown benchmark '{}'\n", mode);
+    return EXIT_FAILURE;
+  }
+}
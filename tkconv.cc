@@ -1,11 +1,343 @@
 #include <fmt/format.h>
 #include <fmt/printf.h>
 #include <iostream>
+#include <thread>
+#include <future>
+#include <atomic>
+#include <map>
 #include "httplib.h"
 #include "sqlwriter.hh"
 #include "pugixml.hpp"
+#include "xmlcompress.hh"
+#include <argparse/argparse.hpp>
+#include "git_version.h"
+#include "support.hh"
 
 using namespace std;
+
+// what a single SyncFeed entry turns into. Made by the parsing threads, written by the writer thread
+struct ConvEntry
+{
+  string id;
+  int skiptoken = -1;
+  bool hasSkiptoken = false; // only if this entry had a 'next' link, otherwise it inherits the previous one
+  bool deleted = false;
+  vector<pair<const char*, SQLiteWriter::var_t>> values; // without id & skiptoken, empty if we don't know this type
+  vector<pair<string, string>> links; // naar, linkSoort
+};
+
+// the xml column of an entry as it came from the database
+struct RawEntry
+{
+  string data;
+  bool compressed;
+};
+
+// a run of consecutive entries from a category
+struct ConvChunk
+{
+  string category;
+  int startskiptoken;
+  bool last = false; // last chunk of this category
+  vector<ConvEntry> entries;
+};
+
+/* How the SyncFeed entities map to our tables. Indexed on the name of the element in <content>.
+   Columns end up in the order listed here, after 'id' and 'skiptoken'.
+   To support a new category, add it here and to the list in main() */
+enum class FSrc { Elem, Ref, Attr, Updated, Bijgewerkt, Enclosure };
+enum class FType { Text, Int, Int64, Double };
+
+struct FieldMap
+{
+  const char* column;
+  FSrc src;
+  const char* xname;
+  FType type = FType::Text;
+};
+
+struct LinkMap
+{
+  const char* xname;
+  const char* linkSoort;
+};
+
+struct EntityMap
+{
+  vector<FieldMap> fields;
+  vector<LinkMap> links;
+};
+
+// text of a child element, by default the one with the same name as the column
+static constexpr FieldMap txt(const char* column, const char* xname = nullptr)
+{
+  return {column, FSrc::Elem, xname ? xname : column};
+}
+static constexpr FieldMap num(const char* column, const char* xname = nullptr, FType type = FType::Int)
+{
+  return {column, FSrc::Elem, xname ? xname : column, type};
+}
+// the 'ref' attribute of a child element
+static constexpr FieldMap ref(const char* column, const char* xname)
+{
+  return {column, FSrc::Ref, xname};
+}
+// attribute of the entity element itself
+static constexpr FieldMap attr(const char* column, const char* xname, FType type = FType::Text)
+{
+  return {column, FSrc::Attr, xname, type};
+}
+static constexpr FieldMap Updated{"updated", FSrc::Updated, ""};
+static constexpr FieldMap Bijgewerkt{"bijgewerkt", FSrc::Bijgewerkt, ""};
+static constexpr FieldMap Enclosure{"enclosure", FSrc::Enclosure, ""};
+
+static const unordered_map<string, EntityMap> g_entities{
+  {"activiteit", {
+      // relaties inkomend, ActiviteitActor, AgendaPunt
+      // twee-weg: Zichzelf (VoortgezetVanuit, VoortgezetIn, VervangenVanuit, VervangenDoor)
+      {txt("nummer"), txt("soort"), txt("onderwerp"), txt("aanvangstijd"), txt("eindtijd"), txt("besloten"),
+       txt("datum"), txt("vrsNummer"), txt("voortouwNaam", "voortouwnaam"), txt("voortouwAfkorting", "voortouwafkorting"),
+       txt("noot"), Updated, Bijgewerkt},
+      {{"vervangenVanuit", "vervangenVanuit"}, {"voortgezetVanuit", "voortgezetVanuit"}}}},
+  {"document", {
+      {txt("nummer", "documentNummer"), ref("agendapuntId", "agendapunt"), txt("soort"), txt("onderwerp"), txt("datum"),
+       Enclosure, ref("bronDocument", "bronDocument"), Updated, Bijgewerkt, ref("kamerstukdossierId", "kamerstukdossier"),
+       num("volgnummer", nullptr, FType::Int64), txt("titel"), txt("citeerTitel"),
+       attr("contentLength", "tk:contentLength", FType::Int64), attr("contentType", "tk:contentType"),
+       ref("huidigeDocumentVersieId", "huidigeDocumentVersie"), txt("vergaderjaar"), txt("aanhangselnummer"),
+       txt("datumRegistratie"), txt("datumOntvangst")},
+      {{"activiteit", "Activiteit"}, {"zaak", "Zaak"}}}},
+  {"zaak", {
+      {txt("nummer"), ref("kamerstukdossierId", "kamerstukdossier"), txt("titel"), txt("onderwerp"), Bijgewerkt,
+       txt("gestartOp"), Updated, txt("organisatie"), txt("soort"), txt("status"), txt("citeertitel"), txt("afgedaan"),
+       txt("grootProject"), txt("vergaderjaar"), txt("volgnummer"), txt("kabinetsappreciatie")},
+      {{"activiteit", "Activiteit"}, {"gerelateerdVanuit", "gerelateerdVanuit"}, {"vervangenVanuit", "vervangenVanuit"},
+       {"agendapunt", "Agendapunt"}}}},
+  {"kamerstukdossier", {
+      {num("nummer"), txt("titel"), txt("afgesloten"), Bijgewerkt, num("hoogsteVolgnummer"), Updated, txt("toevoeging"),
+       txt("citeertitel")}}},
+  {"ns1:toezegging", {
+      /*
+{"ns1:aanmaakdatum": 100, "ns1:achternaam": 100, "ns1:achtervoegsel": 10,
+"ns1:activiteitNummer": 100, "ns1:datumNakoming": 53, "ns1:functie": 100,
+"ns1:initialen": 100, "ns1:kamerbriefNakoming": 53, "ns1:ministerie": 100,
+"ns1:naam": 100, "ns1:nummer": 100, "ns1:status": 100, "ns1:tekst": 100,
+"ns1:titulatuur": 100, "ns1:tussenvoegsel": 27, "ns1:voornaam": 100}
+
+Multi: {"ns1:isAanvullingOp", "ns1:isWijzigingVan"}
+Hasref: {"ns1:activiteit", "ns1:isAanvullingOp", "ns1:isHerhalingVan", "ns1:isWijzigingVan", "ns1:toegezegdAanFractie", "ns1:toegezegdAanPersoon"}
+      */
+      {txt("nummer", "ns1:nummer"), txt("tekst", "ns1:tekst"), txt("kamerbriefNakoming", "ns1:kamerbriefNakoming"),
+       Bijgewerkt, txt("datum", "ns1:aanmaakdatum"), txt("ministerie", "ns1:ministerie"), txt("status", "ns1:status"),
+       txt("datumNakoming", "ns1:datumNakoming"), ref("activiteitId", "ns1:activiteit"),
+       ref("fractieId", "ns1:toegezegdAanFractie"), ref("persoonId", "ns1:toegezegdAanPersoon"),
+       txt("naamToezegger", "ns1:naam"), Updated},
+      {{"ns1:isAanvullingOp", "aanvullingOp"}, {"ns1:isHerhalingVan", "herhalingVan"}, {"ns1:isWijzigingVan", "wijzigingVan"}}}},
+  {"ns1:vergadering", {
+      {Bijgewerkt, Updated, txt("soort", "ns1:soort"), txt("titel", "ns1:titel"), txt("zaal", "ns1:zaal"),
+       txt("vergaderjaar", "ns1:vergaderjaar"), num("nummer", "ns1:vergaderingNummer"), txt("datum", "ns1:datum"),
+       txt("aanvangstijd", "ns1:aanvangstijd"), txt("sluiting", "ns1:sluiting")}}},
+  {"ns1:verslag", {
+      {Bijgewerkt, Updated, txt("soort", "ns1:soort"), txt("status", "ns1:status"),
+       attr("contentLength", "ns1:contentLength", FType::Int64), attr("contentType", "ns1:contentType"), Enclosure,
+       ref("vergaderingId", "ns1:vergadering")}}},
+  {"persoon", {
+      {Bijgewerkt, Updated, txt("functie"), txt("initialen"), txt("tussenvoegsel"), txt("achternaam"), txt("voornamen"),
+       txt("roepnaam"), txt("geboortedatum"), txt("geboorteplaats"), txt("geboorteland"), txt("overlijdensdatum"),
+       txt("overlijdensplaats"), txt("geslacht"), txt("titels"), Enclosure,
+       attr("contentLength", "tk:contentLength", FType::Int64), attr("contentType", "tk:contentType"),
+       txt("woonplaats"), txt("land"), num("nummer")}}},
+  {"fractie", {
+      // {"aantalStemmen": 66, "aantalZetels": 62, "afkorting": 100, "datumActief": 100, "datumInactief": 73, "naamEn": 100, "naamNl": 100, "nummer": 100}
+      {Bijgewerkt, Updated, txt("afkorting"), txt("datumActief"), txt("datumInactief"), txt("naamEn"),
+       txt("naam", "naamNl"), num("nummer"), num("aantalStemmen"), num("aantalZetels")}}},
+  {"besluit", {
+      /*
+	agendapunt='' stemmingsSoort='' besluitSoort='V.k.a. - voor kennisgeving aannemen (commissie)' besluitTekst='Voor kennisgeving aannemen ' opmerking='De vaste commissie voor Defensie heeft de staatssecretaris van Defensie gevraagd om een reactie. De commissie voor de Rijksuitgaven wacht het antwoord met belangstelling af.' status='Besluit' agendapuntZaakBesluitVolgorde='1' zaak='' 
+      */
+      {Bijgewerkt, Updated, txt("soort", "besluitSoort"), txt("stemmingSoort"), txt("tekst", "besluitTekst"),
+       txt("opmerking"), num("agendapuntZaakBesluitVolgorde"), txt("status"), ref("agendapuntId", "agendapunt"),
+       ref("zaakId", "zaak")}}},
+  {"stemming", {
+      {Bijgewerkt, Updated, txt("soort"), txt("actorNaam"), txt("actorFractie"), num("fractieGrootte"),
+       ref("besluitId", "besluit"), ref("fractieId", "fractie"), ref("persoonId", "persoon"), txt("vergissing")}}},
+  {"reservering", {
+      // {"activiteitNummer": 100, "nummer": 100, "statusCode": 38, "statusNaam": 38}
+      {Bijgewerkt, Updated, txt("nummer"), txt("statusCode"), txt("statusNaam"), ref("activiteitId", "activiteit"),
+       ref("zaalId", "zaal"), txt("activiteitNummer")}}},
+  {"zaal", {
+      // {"naam": 100, "sysCode": 100}
+      {Bijgewerkt, Updated, txt("naam"), txt("sysCode")}}},
+  {"persoonReis", {
+      //	{"bestemming": 100, "betaaldDoor": 99, "doel": 99, "gewicht": 100, "totEnMet": 99, "van": 99}
+      {Bijgewerkt, Updated, txt("bestemming"), txt("betaaldDoor"), txt("doel"), num("gewicht"), txt("van"),
+       txt("totEnMet"), ref("persoonId", "persoon")}}},
+  {"persoonNevenfunctie", {
+      //{"gewicht": 100, "isActief": 9, "omschrijving": 100}
+      //Hasref: {"persoon"}
+      {Bijgewerkt, Updated, txt("omschrijving"), num("gewicht"), txt("isActief"), ref("persoonId", "persoon")}}},
+  {"persoonNevenfunctieInkomsten", {
+      /*
+{"bedrag": 75, "bedragAchtervoegsel": 0, "bedragSoort": 69, "bedragValuta": 96, "bedragVoorvoegsel": 12, "frequentie": 52, "frequentieBeschrijving": 2, "jaar": 100, "opmerking": 33}
+Multi: {}
+Hasref: {"persoonNevenfunctie"}
+      */
+      {Bijgewerkt, Updated, num("bedrag", nullptr, FType::Double), txt("bedragAchtervoegsel"), txt("bedragVoorvoegsel"),
+       txt("bedragSoort"), txt("bedragValuta"), txt("frequentie"), txt("frequentieBeschrijving"), num("jaar"),
+       txt("opmerking"), ref("persoonNevenFunctieId", "persoonNevenfunctie")}}},
+  {"fractieZetel", {
+      //{"gewicht": 100}
+      // Hasref: {"fractie"}
+      {Bijgewerkt, Updated, num("gewicht"), ref("fractieId", "fractie")}}},
+  {"fractieZetelPersoon", {
+      //{"functie": 100, "totEnMet": 86, "van": 100}
+      //Hasref: {"fractieZetel", "persoon"}
+      {Bijgewerkt, Updated, num("gewicht"), txt("functie"), txt("van"), txt("totEnMet"),
+       ref("fractieZetelId", "fractieZetel"), ref("persoonId", "persoon")}}},
+  {"documentActor", {
+      {Bijgewerkt, Updated, txt("naam", "actorNaam"), txt("fractie", "actorFractie"), txt("functie"), txt("relatie"),
+       ref("documentId", "document"), ref("commissieId", "commissie"), ref("persoonId", "persoon"),
+       ref("fractieId", "fractie")}}},
+  {"zaakActor", {
+      {Bijgewerkt, Updated, txt("naam", "actorNaam"), txt("fractie", "actorFractie"), txt("functie"), txt("relatie"),
+       txt("afkorting", "actorAfkorting"), ref("zaakId", "zaak"), ref("persoonId", "persoon"),
+       ref("commissieId", "commissie"), ref("fractieId", "fractie")}}},
+  {"agendapunt", {
+      // activiteit='' nummer='2008P01291' onderwerp='Beantwoording vragen commissie over het evaluatierapport Belastinguitgaven op het terrein van de accijnzen' aanvangstijd='' eindtijd='' volgorde='40' rubriek='Stukken/brieven (als eerste) ondertekend door de staatssecretaris van Financiën' noot='De antwoorden op de door de commissie gestelde vragen zijn ontvangen op 15 juli 2008 (31200-IXB, nr. 35)' status='Vrijgegeven' 
+      {Bijgewerkt, Updated, txt("nummer"), txt("onderwerp"), txt("aanvangstijd"), txt("eindtijd"), num("volgorde"),
+       txt("rubriek"), txt("noot"), txt("status"), ref("activiteitId", "activiteit")}}},
+  {"persoonGeschenk", {
+      {Bijgewerkt, Updated, txt("omschrijving"), txt("datum"), num("gewicht"), ref("persoonId", "persoon")}}},
+  {"documentVersie", {
+      {Bijgewerkt, Updated, txt("datum"), txt("extensie"), txt("externeidentifier"), txt("status"),
+       num("versienummer"), num("bestandsgrootte"), ref("documentId", "document")}}},
+  {"commissieContactinformatie", {
+      /*
+{"gewicht": 100, "soort": 100, "waarde": 100}
+Multi: {}
+Hasref: {"commissie"}
+      */
+      {Bijgewerkt, Updated, num("gewicht"), txt("soort"), txt("waarde"), ref("commissieId", "commissie")}}},
+  {"commissieZetel", {
+      /*
+{"gewicht": 100}
+Multi: {}
+Hasref: {"commissie"}
+      */
+      {Bijgewerkt, Updated, num("gewicht"), ref("commissieId", "commissie")}}},
+  {"commissieZetelVastPersoon", {
+      /*
+	CommissieZetelVastPersoon: 
+	{"functie": 100, "totEnMet": 91, "van": 100}
+	Multi: {}
+	Hasref: {"commissieZetel", "persoon"}
+      */
+      {Bijgewerkt, Updated, txt("functie"), txt("totEnMet"), txt("van"), num("gewicht"),
+       ref("commissieZetelId", "commissieZetel"), ref("persoonId", "persoon")}}},
+  {"commissieZetelVervangerPersoon", {
+      {Bijgewerkt, Updated, txt("functie"), txt("totEnMet"), txt("van"), num("gewicht"),
+       ref("commissieZetelId", "commissieZetel"), ref("persoonId", "persoon")}}},
+  {"activiteitActor", {
+      {Bijgewerkt, Updated, txt("functie"), txt("relatie"), txt("naam", "actorNaam"), txt("fractie", "actorFractie"),
+       txt("spreektijd"), num("volgorde"), ref("activiteitId", "activiteit"), ref("persoonId", "persoon"),
+       ref("fractieId", "fractie"), ref("commissieId", "commissie")}}},
+  {"commissie", {
+      // nummer='62750' soort='Dienst Commissieondersteuning Internationaal en Ruimtelijk' afkorting='AM' naamNl='Vaste commissie voor Asiel en Migratie' naamEn='Asylum and Migration' naamWebNl='Asiel en Migratie' naamWebEn='Asylum and Migration' inhoudsopgave='Vaste commissies' datumActief='2024-07-02' datumInactief='' 
+      {Bijgewerkt, Updated, num("nummer"), txt("soort"), txt("afkorting"), txt("naam", "naamNl"), txt("naamEn"),
+       txt("webNaam", "naamWebNl"), txt("inhoudsopgave"), txt("datumActief"), txt("datumInactief")}}}
+};
+
+// parses in place, so xml gets overwritten. pnode gets reused from entry to entry to save on allocations
+static ConvEntry parseEntry(const std::string& category, char* xml, size_t len, pugi::xml_document& pnode)
+{
+  ConvEntry ce;
+  if (!pnode.load_buffer_inplace(xml, len))
+    throw runtime_error("Could not load XML entry for category "+category);
+
+  pugi::xml_node node = pnode.child("entry");
+  string id = node.child("title").child_value();
+  string updated = node.child("updated").child_value();
+  string enclosure;
+  ce.id = id;
+
+  for (auto link : node.children("link")) {
+    if(link.attribute("rel").value() == string("enclosure")) {
+      enclosure = link.attribute("href").value();
+    }
+    else if(link.attribute("rel").value() == string("next")) {
+      if(auto href = link.attribute("href")) {
+	string next = href.value();
+	// https://gegevensmagazijn.tweedekamer.nl/SyncFeed/2.0/Feed?skiptoken=20127222&category=Document
+	if(next.find("https://gegevensmagazijn.tweedekamer.nl/SyncFeed/2.0/Feed"))
+	  throw std::runtime_error("Unexpected next URL format "+next);
+	if(auto pos = next.find("skiptoken="); pos ==string::npos)
+	  throw std::runtime_error("Could not find skiptoken in "+next);
+	else {
+	  ce.skiptoken = atoi(next.substr(pos+10).c_str());
+	  ce.hasSkiptoken = true;
+	}
+      }
+    }
+  }
+  string bijgewerkt=node.child("content").begin()->attribute("tk:bijgewerkt").value();
+  string lcat = category;
+  lcat[0] = tolower(lcat[0]);
+  if(auto child = node.child("content").child(lcat.c_str()); child.attribute("tk:verwijderd").value() == string("true") ||
+							     child.attribute("ns1:verwijderd").value() == string("true")) {
+    ce.deleted = true;
+    return ce;
+  }
+
+  auto child = node.child("content").first_child();
+  auto iter = g_entities.find(child.name());
+  if(iter == g_entities.end())
+    return ce; // we don't know this type (yet)
+
+  for(const auto& l : iter->second.links) {
+    for(auto& a : child.children(l.xname))
+      ce.links.emplace_back(a.attribute("ref").value(), l.linkSoort);
+  }
+  ce.values.reserve(iter->second.fields.size() + 2); // writer adds id & skiptoken
+  for(const auto& f : iter->second.fields) {
+    const char* val = "";
+    switch(f.src) {
+    case FSrc::Elem:
+      val = child.child(f.xname).child_value();
+      break;
+    case FSrc::Ref:
+      val = child.child(f.xname).attribute("ref").value();
+      break;
+    case FSrc::Attr:
+      val = child.attribute(f.xname).value();
+      break;
+    case FSrc::Updated:
+      val = updated.c_str();
+      break;
+    case FSrc::Bijgewerkt:
+      val = bijgewerkt.c_str();
+      break;
+    case FSrc::Enclosure:
+      val = enclosure.c_str();
+      break;
+    }
+    switch(f.type) {
+    case FType::Text:
+      ce.values.emplace_back(f.column, string(val));
+      break;
+    case FType::Int:
+      ce.values.emplace_back(f.column, atoi(val));
+      break;
+    case FType::Int64:
+      ce.values.emplace_back(f.column, (int64_t)atoi(val));
+      break;
+    case FType::Double:
+      ce.values.emplace_back(f.column, atof(val));
+      break;
+    }
+  }
+  return ce;
+}
+
 int main(int argc, char** argv)
 {
   vector<string> categories={
@@ -21,25 +353,65 @@ int main(int argc, char** argv)
     "Zaal"
   };
 
-  if(argc > 1) {
+  argparse::ArgumentParser args("tkconv", GIT_VERSION);
+  args.add_argument("-j", "--threads").help("number of threads parsing XML").default_value((int)max(1U, thread::hardware_concurrency())).scan<'i', int>();
+  args.add_argument("--batch").help("entries per transaction").default_value(20000).scan<'i', int>();
+  args.add_argument("categories").help("categories to convert, default is all of them").nargs(argparse::nargs_pattern::any).default_value(vector<string>());
+  try {
+    args.parse_args(argc, argv);
+  }
+  catch (const std::exception& err) {
+    cerr << err.what() << endl;
+    cerr << args;
+    return EXIT_FAILURE;
+  }
+
+  if(auto cats = args.get<vector<string>>("categories"); !cats.empty()) {
     categories.clear();
-    for(int n = 1 ; n < argc; ++n) {
-      string cat = argv[n];
+    for(const auto& c : cats) {
+      string cat = c;
       if(cat.empty())
 	throw runtime_error("Can't have empty category");
       cat[0]=toupper(cat[0]);
     
-      categories.push_back(argv[n]);
+      categories.push_back(cat);
     }
   }
-  SQLiteWriter sqlw("tk.sqlite3");
+  int numthreads = max(1, args.get<int>("--threads"));
+  unsigned int batchsize = max(1, args.get<int>("--batch"));
+  setWALMode("tk.sqlite3"); // so tkserv can keep reading while we write
+  SQLiteWriter sqlw("tk.sqlite3", {}, SQLWFlag::NoTransactions); // the writer thread does the transactions
   SQLiteWriter xmlstore("xml.sqlite3");
+  XMLCompressor xc(xmlstore);
+  SQLiteReader xmlreader("xml.sqlite3"); // so we can stream the entries
 
   sqlw.query("create table if not exists link (van TEXT, naar TEXT) STRICT");
   sqlw.query("create index if not exists linkvanidx on link(van)");
   sqlw.query("create index if not exists linknaaridx on link(naar)");
   sqlw.query("create unique index if not exists linkvannaaridx on link(van,naar)");
-  
+
+  /* Parsing is done in chunks by a pool of threads, writing is done by a single thread.
+     The chunks come out in the same order they went in, so the end result is identical to doing it all serially.
+     The skiptoken of an entry depends on the entries before it, so the writer works that out */
+  BoundedQueue<packaged_task<ConvChunk()>> tasks(2*numthreads);
+  BoundedQueue<future<ConvChunk>> results(4*numthreads);
+  vector<thread> parsers;
+  for(int n = 0; n < numthreads; ++n) {
+    parsers.emplace_back([&tasks]() {
+      packaged_task<ConvChunk()> task;
+      while(tasks.pop(task))
+        task();
+    });
+  }
+
+  /* openvragen only changes for zaken we saw a Zaak or Document for. We note those in the same transactions
+     as the rows themselves, so after a crash the next run still knows which zaken to redo.
+     Without an openvragen table we build all of it at the end anyway */
+  bool haveOV = !sqlw.queryT("select name from sqlite_master where type='table' and name='openvragen'").empty();
+  sqlw.query("create table if not exists openvragentodo (id TEXT PRIMARY KEY, category TEXT) STRICT");
+
+  // once the writer starts it has sqlw to itself, anything else would end up in its transactions
+  map<string, int> starts;
   for(const auto& category: categories) {
     sqlw.query("create table if not exists "+category+" ('id' TEXT PRIMARY KEY, 'skiptoken' INT) STRICT");
     sqlw.query("create index if not exists "+category+"skipidx on "+category+"('skiptoken')");
@@ -53,772 +425,175 @@ int main(int argc, char** argv)
     catch(std::exception& e) {
       fmt::print("Could not get a 'skiptoken' from database for category {}, starting from scratch\n", category);
     }
-    int numentries=0, deleterequests=0;
-    unordered_set<string> dels, adds;
-    auto entries = xmlstore.queryT("select * from "+category+" where skiptoken > ?", {skiptoken});
-    for(auto& exml : entries) {
-      pugi::xml_document pnode;
-      if (!pnode.load_string( (get<string>(exml["xml"])).c_str())) {
-	cout<<"Could not load"<<endl;
-	return -1;
-      }
-      pugi::xml_node node = pnode.child("entry");
-      string id = node.child("title").child_value();
-      string updated = node.child("updated").child_value();
-      string enclosure;
-      numentries++;
-
-      for (auto link : node.children("link")) {
-	if(link.attribute("rel").value() == string("enclosure")) {
-	  enclosure = link.attribute("href").value();
-	}
-	else if(link.attribute("rel").value() == string("next")) {
-	  if(auto href = link.attribute("href")) {
-	    string next = href.value();
-	    // https://gegevensmagazijn.tweedekamer.nl/SyncFeed/2.0/Feed?skiptoken=20127222&category=Document
-	    if(next.find("https://gegevensmagazijn.tweedekamer.nl/SyncFeed/2.0/Feed"))
-	    throw std::runtime_error("Unexpected next URL format "+next);
-	    if(auto pos = next.find("skiptoken="); pos ==string::npos)
-	      throw std::runtime_error("Could not find skiptoken in "+next);
-	    else {
-	      skiptoken = atoi(next.substr(pos+10).c_str());
-	    }
-	  }
-	}
-      }
-      string bijgewerkt=node.child("content").begin()->attribute("tk:bijgewerkt").value();
-      string lcat = category;
-      lcat[0] = tolower(lcat[0]);
-      if(auto child = node.child("content").child(lcat.c_str()); child.attribute("tk:verwijderd").value() == string("true") ||
-							         child.attribute("ns1:verwijderd").value() == string("true")) {
-        sqlw.query("delete from "+category+" where id=?", {id});
-        sqlw.query("delete from link where van=?", {id});
-        sqlw.query("delete from link where naar=?", {id});
-	deleterequests++;
-	dels.insert(id);
-	continue;
-      }
-      adds.insert(id);
-      if(auto child = node.child("content").child("activiteit")) {
-	// relaties inkomend, ActiviteitActor, AgendaPunt
-	// twee-weg: Zichzelf (VoortgezetVanuit, VoortgezetIn, VervangenVanuit, VervangenDoor)
-	
-	string datum = child.child("datum").child_value();
-	string onderwerp = child.child("onderwerp").child_value();
-	string noot = child.child("noot").child_value();
-	string soort = child.child("soort").child_value();
-	string aanvangstijd = child.child("aanvangstijd").child_value();
-	string eindtijd = child.child("eindtijd").child_value();
-	string vrsNummer = child.child("vrsNummer").child_value();
-	string voortouwnaam = child.child("voortouwnaam").child_value();
-	string besloten = child.child("besloten").child_value();
-
-	string voortouwafkorting = child.child("voortouwafkorting").child_value();
-	string nummer = child.child("nummer").child_value();
-	auto repl = [&](string name) {
-	  string lname = name;
-	  lname[0] = tolower(lname[0]);
-	  for(auto& a : child.children(lname.c_str())) {
-	    sqlw.addOrReplaceValue({{"skiptoken", skiptoken}, {"category", category}, {"van", id}, {"naar", a.attribute("ref").value()}, {"linkSoort", name}}, "link");
-	  }
-	};
-	repl("vervangenVanuit");
-	repl("voortgezetVanuit");
-	
-	sqlw.addOrReplaceValue({{"id", id}, {"skiptoken", skiptoken}, {"nummer", nummer}, {"soort", soort}, {"onderwerp", onderwerp},
-		       {"aanvangstijd", aanvangstijd}, {"eindtijd", eindtijd}, {"besloten", besloten},
-		       {"datum", datum}, {"vrsNummer", vrsNummer}, {"voortouwNaam", voortouwnaam} , {"voortouwAfkorting", voortouwafkorting}, {"noot", noot}, {"updated", updated}, {"bijgewerkt", bijgewerkt}}, category);
-	  
-      }
-      else if(auto child = node.child("content").child("document")) {
-	string datum = child.child("datum").child_value();
-	string soort = child.child("soort").child_value();
-	string onderwerp = child.child("onderwerp").child_value();
-	string titel = child.child("titel").child_value();
-	string contentType = child.attribute("tk:contentType").value();
-	int64_t contentLength = atoi(child.attribute("tk:contentLength").value());
-	string vergaderjaar = child.child("vergaderjaar").child_value();
-	string aanhangselnummer = child.child("aanhangselnummer").child_value();
-	string documentNummer = child.child("documentNummer").child_value();
-	string citeerTitel = child.child("citeerTitel").child_value();
-	string datumRegistratie = child.child("datumRegistratie").child_value();
-	string datumOntvangst = child.child("datumOntvangst").child_value();
-	string huidigeDocumentVersieId = child.child("huidigeDocumentVersie").attribute("ref").value();
-	string bronDocument = child.child("bronDocument").attribute("ref").value();
-	string agendapuntId = child.child("agendapunt").attribute("ref").value();
-	string kamerstukdossierId = child.child("kamerstukdossier").attribute("ref").value();
-	int64_t volgnummer = atoi(child.child("volgnummer").child_value());;
-
-	auto repl = [&](string name) {
-	  string lname = name;
-	  lname[0] = tolower(lname[0]);
-	  for(auto& activiteit : child.children(lname.c_str())) {
-	    sqlw.addOrReplaceValue({{"skiptoken", skiptoken}, {"category", category}, {"van", id}, {"naar", activiteit.attribute("ref").value()}, {"linkSoort", name}}, "link");
-	  }
-	};
-
-	repl("Activiteit");
-	repl("Zaak");
-	
-	sqlw.addOrReplaceValue({{"id", id},  {"skiptoken", skiptoken}, {"nummer", documentNummer}, {"agendapuntId", agendapuntId}, {"soort", soort}, {"onderwerp", onderwerp}, {"datum", datum}, {"enclosure", enclosure}, {"bronDocument", bronDocument}, {"updated", updated}, {"bijgewerkt", bijgewerkt}, {"kamerstukdossierId", kamerstukdossierId}, {"volgnummer", volgnummer}, {"titel", titel}, {"citeerTitel", citeerTitel}, {"contentLength", contentLength}, {"contentType", contentType}, {"huidigeDocumentVersieId", huidigeDocumentVersieId}, {"vergaderjaar", vergaderjaar}, {"aanhangselnummer", aanhangselnummer},{"datumRegistratie", datumRegistratie}, {"datumOntvangst", datumOntvangst}}, category);
-      }
-      else if(auto child = node.child("content").child("zaak")) {
-	  
-	string gestartOp = child.child("gestartOp").child_value();
-	string onderwerp = child.child("onderwerp").child_value();
-	string titel = child.child("titel").child_value();
-	string zaakNummer = child.child("nummer").child_value();
-	string kabinetsappreciatie = child.child("kabinetsappreciatie").child_value();
-	string organisatie = child.child("organisatie").child_value();
-	string soort = child.child("soort").child_value();
-	string status = child.child("status").child_value();
-	string citeertitel =child.child("citeertitel").child_value();
-	string afgedaan =child.child("afgedaan").child_value();
-	string grootProject =child.child("grootProject").child_value();
-	string vergaderjaar =child.child("vergaderjaar").child_value();
-	string volgnummer =child.child("volgnummer").child_value();
-		
-	string kamerstukdossierId = child.child("kamerstukdossier").attribute("ref").value();
-
-	auto repl = [&](string name) {
-	  string lname = name;
-	  lname[0] = tolower(lname[0]);
-	  for(auto& a : child.children(lname.c_str())) {
-	    sqlw.addOrReplaceValue({{"skiptoken", skiptoken}, {"category", category}, {"van", id}, {"naar", a.attribute("ref").value()}, {"linkSoort", name}}, "link");
-	  }
-	};
-	repl("Activiteit");
-	repl("gerelateerdVanuit");
-	repl("vervangenVanuit");
-	repl("Agendapunt");
-	
-	sqlw.addOrReplaceValue({{"id", id}, {"skiptoken", skiptoken}, {"nummer", zaakNummer}, {"kamerstukdossierId", kamerstukdossierId}, {"titel", titel}, {"onderwerp", onderwerp}, {"bijgewerkt", bijgewerkt},{"gestartOp", gestartOp}, {"updated", updated},
-		       {"organisatie", organisatie},
-		       {"soort", soort},
-		       {"status", status},
-		       {"citeertitel", citeertitel},
-		       {"afgedaan", afgedaan},
-		       {"grootProject", grootProject},
-		       {"vergaderjaar", vergaderjaar},
-		       {"volgnummer", volgnummer},
-		       {"kabinetsappreciatie", kabinetsappreciatie}
-	  }, category);
-	  
-      }
-      else if(auto child = node.child("content").child("kamerstukdossier")) {
-	string titel = child.child("titel").child_value();
-	int nummer = atoi(child.child("nummer").child_value());
-	string toevoeging = child.child("toevoeging").child_value();
-	string citeertitel = child.child("citeertitel").child_value();
-	string afgesloten = child.child("afgesloten").child_value();
-	int hoogsteVolgnummer = atoi(child.child("hoogsteVolgnummer").child_value());
-	sqlw.addOrReplaceValue({{"id", id}, {"skiptoken", skiptoken}, {"nummer", nummer}, {"titel", titel}, {"afgesloten", afgesloten}, {"bijgewerkt", bijgewerkt},{"hoogsteVolgnummer", hoogsteVolgnummer}, {"updated", updated}, {"toevoeging", toevoeging}, {"citeertitel", citeertitel}}, category);
-      }
-      else if(auto child = node.child("content").child("ns1:toezegging")) {
-	/*
-{"ns1:aanmaakdatum": 100, "ns1:achternaam": 100, "ns1:achtervoegsel": 10,
-"ns1:activiteitNummer": 100, "ns1:datumNakoming": 53, "ns1:functie": 100,
-"ns1:initialen": 100, "ns1:kamerbriefNakoming": 53, "ns1:ministerie": 100,
-"ns1:naam": 100, "ns1:nummer": 100, "ns1:status": 100, "ns1:tekst": 100,
-"ns1:titulatuur": 100, "ns1:tussenvoegsel": 27, "ns1:voornaam": 100}
-
-Multi: {"ns1:isAanvullingOp", "ns1:isWijzigingVan"}
-Hasref: {"ns1:activiteit", "ns1:isAanvullingOp", "ns1:isHerhalingVan", "ns1:isWijzigingVan", "ns1:toegezegdAanFractie", "ns1:toegezegdAanPersoon"}
-	*/
-
-	auto repl = [&](string xname, string name) {
-	  for(auto& a : child.children(xname.c_str())) {
-	    sqlw.addOrReplaceValue({{"skiptoken", skiptoken}, {"category", category}, {"van", id}, {"naar", a.attribute("ref").value()}, {"linkSoort", name}}, "link");
-	  }
-	};
-	repl("ns1:isAanvullingOp", "aanvullingOp");
-	repl("ns1:isHerhalingVan", "herhalingVan");
-	repl("ns1:isWijzigingVan", "wijzigingVan");
-
-	string tekst = child.child("ns1:tekst").child_value();
-	string naamToezegger = child.child("ns1:naam").child_value();
-	string nummer = child.child("ns1:nummer").child_value();
-	string kamerbriefNakoming = child.child("ns1:kamerbriefNakoming").child_value();
-	string ministerie = child.child("ns1:ministerie").child_value();
-	string status = child.child("ns1:status").child_value();
-	string datum = child.child("ns1:aanmaakdatum").child_value();
-	string datumNakoming = child.child("ns1:datumNakoming").child_value();
-	
-	string activiteitId = child.child("ns1:activiteit").attribute("ref").value();
-	string fractieId = child.child("ns1:toegezegdAanFractie").attribute("ref").value();
-	string persoonId = child.child("ns1:toegezegdAanPersoon").attribute("ref").value();
-	//	Multi: {"ns1:isAanvullingOp", "ns1:isWijzigingVan"} XXX
-
-	sqlw.addOrReplaceValue({{"id", id}, {"skiptoken", skiptoken}, {"nummer", nummer}, {"tekst", tekst},
-		       {"kamerbriefNakoming", kamerbriefNakoming}, {"bijgewerkt", bijgewerkt},
-		       {"datum", datum}, {"ministerie", ministerie},
-		       {"status", status},
-		       {"datumNakoming", datumNakoming},
-		       {"activiteitId", activiteitId},
-		       {"fractieId", fractieId},
-		       {"persoonId", persoonId},
-		       {"naamToezegger", naamToezegger},
-		       {"updated", updated}}, category);
-      }
-      else if(auto child = node.child("content").child("ns1:vergadering")) {
-	  
-	auto child2 = *node.child("content").begin();
-	map<string,string> fields;
-	for(const auto&c : child2) {
-	  fields[c.name()]= c.child_value();
-	}
-	  
-	sqlw.addOrReplaceValue({{"id", id}, {"skiptoken", skiptoken}, {"bijgewerkt", bijgewerkt},
-		       {"updated", updated}, {"soort", fields["ns1:soort"]},
-		       {"titel", fields["ns1:titel"]},
-		       {"zaal", fields["ns1:zaal"]},
-		       {"vergaderjaar", fields["ns1:vergaderjaar"]},
-		       {"nummer", atoi(fields["ns1:vergaderingNummer"].c_str())},
-		       {"datum", fields["ns1:datum"]},
-		       {"aanvangstijd", fields["ns1:aanvangstijd"]},
-		       {"sluiting", fields["ns1:sluiting"]}}, category);
-	  
-      }
-      else if(auto child = node.child("content").child("ns1:verslag")) { 
-	auto child2 = *node.child("content").begin();
-	map<string,string> fields;
-	for(const auto&c : child2) {
-	  fields[c.name()]= c.child_value();
-	}
-	string vergaderingId = child2.child("ns1:vergadering").attribute("ref").value();
-	int64_t contentLength = atoi(child.attribute("ns1:contentLength").value());;
-	string contentType = child.attribute("ns1:contentType").value();
-	sqlw.addOrReplaceValue({{"id", id}, {"skiptoken", skiptoken}, {"bijgewerkt", bijgewerkt},
-		       {"updated", updated}, {"soort", fields["ns1:soort"]},
-		       {"status", fields["ns1:status"]}, {"contentLength", contentLength},
-		       {"contentType", contentType},
-		       {"enclosure", enclosure},
-		       {"vergaderingId", vergaderingId}},
-	  category);
-      }
-      else if(auto child = node.child("content").child("persoon")) { 
-	auto child2 = *node.child("content").begin();
-	map<string,string> fields;
-	for(const auto&c : child2) {
-	  fields[c.name()]= c.child_value();
-	}
-
-	int64_t contentLength = atoi(child.attribute("tk:contentLength").value());
-	string contentType = child.attribute("tk:contentType").value();
-	sqlw.addOrReplaceValue({{"id", id}, {"skiptoken", skiptoken}, {"bijgewerkt", bijgewerkt},
-		       {"updated", updated}, {"functie", fields["functie"]},
-		       {"initialen", fields["initialen"]},
-		       {"tussenvoegsel", fields["tussenvoegsel"]},
-		       {"achternaam", fields["achternaam"]},
-		       {"voornamen", fields["voornamen"]},
-		       {"roepnaam", fields["roepnaam"]},
-		       {"geboortedatum", fields["geboortedatum"]},
-		       {"geboorteplaats", fields["geboorteplaats"]},
-		       {"geboorteland", fields["geboorteland"]},
-		       {"overlijdensdatum", fields["overlijdensdatum"]},
-		       {"overlijdensplaats", fields["overlijdensplaats"]},
-			 
-		       {"geslacht", fields["geslacht"]},
-		       {"titels", fields["titels"]},
-		       {"enclosure", enclosure},
-		       {"contentLength", contentLength},
-		       {"contentType", contentType},
-		       {"woonplaats", fields["woonplaats"]},
-		       {"land", fields["land"]},
-		       {"nummer", atoi(fields["nummer"].c_str())}},
-	    
-	  category);
-      }
-      else if(auto child = node.child("content").child("fractie")) { 
-	  
-	auto child2 = *node.child("content").begin();
-	map<string,string> fields;
-	for(const auto&c : child2) {
-	  fields[c.name()]= c.child_value();
-	}
-	// {"aantalStemmen": 66, "aantalZetels": 62, "afkorting": 100, "datumActief": 100, "datumInactief": 73, "naamEn": 100, "naamNl": 100, "nummer": 100}
- 
-	
-	sqlw.addOrReplaceValue({{"id", id}, {"skiptoken", skiptoken}, {"bijgewerkt", bijgewerkt},
-		       {"updated", updated}, 
-		       {"afkorting", fields["afkorting"]},
-		       {"datumActief", fields["datumActief"]},
-		       {"datumInactief", fields["datumInactief"]},
-		       {"naamEn", fields["naamEn"]},
-		       {"naam", fields["naamNl"]},
-		       {"nummer", atoi(fields["nummer"].c_str())},		       
-		       {"aantalStemmen", atoi(fields["aantalStemmen"].c_str())},
-		       {"aantalZetels", atoi(fields["aantalZetels"].c_str())}
-	  },	    
-	  category);
-      }
-      else if(auto child = node.child("content").child("besluit")) { 
-	  
-	auto child2 = *node.child("content").begin();
-	map<string,string> fields;
-	for(const auto&c : child2) {
-	  fields[c.name()]= c.child_value();
-	}
-	  
-	/*
-	  agendapunt='' stemmingsSoort='' besluitSoort='V.k.a. - voor kennisgeving aannemen (commissie)' besluitTekst='Voor kennisgeving aannemen ' opmerking='De vaste commissie voor Defensie heeft de staatssecretaris van Defensie gevraagd om een reactie. De commissie voor de Rijksuitgaven wacht het antwoord met belangstelling af.' status='Besluit' agendapuntZaakBesluitVolgorde='1' zaak='' 
-	*/
-
-	string agendapuntId = child2.child("agendapunt").attribute("ref").value();
-	string zaakId = child2.child("zaak").attribute("ref").value();
-	  
-	sqlw.addOrReplaceValue({{"id", id}, {"skiptoken", skiptoken}, {"bijgewerkt", bijgewerkt},
-		       {"updated", updated}, {"soort", fields["besluitSoort"]},
-		       {"stemmingSoort", fields["stemmingSoort"]},
-		       {"tekst", fields["besluitTekst"]},
-		       {"opmerking", fields["opmerking"]},
-		       {"agendapuntZaakBesluitVolgorde", atoi(fields["agendapuntZaakBesluitVolgorde"].c_str())},
-		       {"status", fields["status"]},
-		       {"agendapuntId", agendapuntId},
-		       {"zaakId", zaakId}},
-	  category);
-	  
-	  
-      }
-      else if(auto child = node.child("content").child("stemming")) {
-	  
-	auto child2 = *node.child("content").begin();
-	map<string,string> fields;
-	for(const auto&c : child2) {
-	  fields[c.name()]= c.child_value();
-	}
-	  
-	string besluitId = child2.child("besluit").attribute("ref").value();
-	string fractieId = child2.child("fractie").attribute("ref").value();
-	string persoonId = child2.child("persoon").attribute("ref").value();
-
-	sqlw.addOrReplaceValue({{"id", id}, {"skiptoken", skiptoken}, {"bijgewerkt", bijgewerkt},
-		       {"updated", updated}, {"soort", fields["soort"]},
-		       {"actorNaam", fields["actorNaam"]},
-		       {"actorFractie", fields["actorFractie"]},
-		       {"fractieGrootte", atoi(fields["fractieGrootte"].c_str())},
-		       {"besluitId", besluitId},
-		       {"fractieId", fractieId},
-		       {"persoonId", persoonId},
-		       {"vergissing", fields["vergissing"]}
-	  },
-	  category);
-      }
-      else if(auto child = node.child("content").child("reservering")) {
-	
-	auto child2 = *node.child("content").begin();
-	map<string,string> fields;
-	for(const auto&c : child2) {
-	  fields[c.name()]= c.child_value();
-	}
-	  
-	string activiteitId = child2.child("activiteit").attribute("ref").value();
-	string zaalId = child2.child("zaal").attribute("ref").value();
-
-	// {"activiteitNummer": 100, "nummer": 100, "statusCode": 38, "statusNaam": 38}
-	
-	sqlw.addOrReplaceValue({{"id", id}, {"skiptoken", skiptoken}, {"bijgewerkt", bijgewerkt},
-		       {"updated", updated}, {"nummer", fields["nummer"]},
-		       {"statusCode", fields["statusCode"]},
-		       {"statusNaam", fields["statusNaam"]},
-		       {"activiteitId", activiteitId},
-		       {"zaalId", zaalId},
-		       {"activiteitNummer", fields["activiteitNummer"]}
-	  },
-	  category);
-      }
-      else if(auto child = node.child("content").child("zaal")) {
-	auto child2 = *node.child("content").begin();
-	map<string,string> fields;
-	for(const auto&c : child2) {
-	  fields[c.name()]= c.child_value();
-	}
-	  
-	// {"naam": 100, "sysCode": 100}
-
-	sqlw.addOrReplaceValue({{"id", id}, {"skiptoken", skiptoken}, {"bijgewerkt", bijgewerkt},
-		       {"updated", updated}, {"naam", fields["naam"]},
-		       {"sysCode", fields["sysCode"]}
-	  },
-	  category);
-      }
-      else if(auto child = node.child("content").child("persoonReis")) {
-	auto child2 = *node.child("content").begin();
-	map<string,string> fields;
-	for(const auto&c : child2) {
-	  fields[c.name()]= c.child_value();
-	}
-	  
-	//	{"bestemming": 100, "betaaldDoor": 99, "doel": 99, "gewicht": 100, "totEnMet": 99, "van": 99}
-	string persoonId = child2.child("persoon").attribute("ref").value();
-	sqlw.addOrReplaceValue({{"id", id}, {"skiptoken", skiptoken}, {"bijgewerkt", bijgewerkt},
-		       {"updated", updated}, {"bestemming", fields["bestemming"]},
-		       {"betaaldDoor", fields["betaaldDoor"]},
-		       {"doel", fields["doel"]},
-		       {"gewicht", atoi(fields["gewicht"].c_str())},
-		       {"van", fields["van"]},
-		       {"totEnMet", fields["totEnMet"]},
-		       {"persoonId", persoonId}
-
-		       
-	  },
-	  category);
-      }
-      else if(auto child = node.child("content").child("persoonNevenfunctie")) {
-	auto child2 = *node.child("content").begin();
-	map<string,string> fields;
-	for(const auto&c : child2) {
-	  fields[c.name()]= c.child_value();
-	}
-	//{"gewicht": 100, "isActief": 9, "omschrijving": 100}
-	//Hasref: {"persoon"}
-
-	string persoonId = child2.child("persoon").attribute("ref").value();
-	sqlw.addOrReplaceValue({{"id", id}, {"skiptoken", skiptoken}, {"bijgewerkt", bijgewerkt},
-		       {"updated", updated}, {"omschrijving", fields["omschrijving"]},
-		       {"gewicht", atoi(fields["gewicht"].c_str())},
-		       {"isActief", fields["isActief"]},
-		       {"persoonId", persoonId}
-	  },
-	  category);
-      }
-      else if(auto child = node.child("content").child("persoonNevenfunctieInkomsten")) {
-	auto child2 = *node.child("content").begin();
-	map<string,string> fields;
-	for(const auto&c : child2) {
-	  fields[c.name()]= c.child_value();
-	}
-	/*
-{"bedrag": 75, "bedragAchtervoegsel": 0, "bedragSoort": 69, "bedragValuta": 96, "bedragVoorvoegsel": 12, "frequentie": 52, "frequentieBeschrijving": 2, "jaar": 100, "opmerking": 33}
-Multi: {}
-Hasref: {"persoonNevenfunctie"}
-	*/
-	//Hasref: {"persoon"}
-
-	string persoonNevenFunctieId = child2.child("persoonNevenfunctie").attribute("ref").value();
-	sqlw.addOrReplaceValue({{"id", id}, {"skiptoken", skiptoken}, {"bijgewerkt", bijgewerkt},
-		       {"updated", updated}, {"bedrag", atof(fields["bedrag"].c_str())},
-		       {"bedragAchtervoegsel", fields["bedragAchtervoegsel"]},
-		       {"bedragVoorvoegsel", fields["bedragVoorvoegsel"]},
-		       {"bedragSoort", fields["bedragSoort"]},
-		       {"bedragValuta", fields["bedragValuta"]},
-		       {"frequentie", fields["frequentie"]},
-		       {"frequentieBeschrijving", fields["frequentieBeschrijving"]},
-		       {"jaar", atoi(fields["jaar"].c_str())},
-		       {"opmerking", fields["opmerking"]},
-		       {"persoonNevenFunctieId", persoonNevenFunctieId}
-	  },
-	  category);
-      }
-      else if(auto child = node.child("content").child("fractieZetel")) {
-	auto child2 = *node.child("content").begin();
-	map<string,string> fields;
-	for(const auto&c : child2) {
-	  fields[c.name()]= c.child_value();
-	}
-	//{"gewicht": 100}
-	// Hasref: {"fractie"}
-
-	string fractieId = child2.child("fractie").attribute("ref").value();
-	sqlw.addOrReplaceValue({{"id", id}, {"skiptoken", skiptoken}, {"bijgewerkt", bijgewerkt},
-		       {"updated", updated}, 
-		       {"gewicht", atoi(fields["gewicht"].c_str())},
-		       {"fractieId", fractieId}
-	  },
-	  category);
-      }
-      else if(auto child = node.child("content").child("fractieZetelPersoon")) {
-	auto child2 = *node.child("content").begin();
-	map<string,string> fields;
-	for(const auto&c : child2) {
-	  fields[c.name()]= c.child_value();
-	}
-	//{"functie": 100, "totEnMet": 86, "van": 100}
-	//Hasref: {"fractieZetel", "persoon"}
-
-	string fractieZetelId = child2.child("fractieZetel").attribute("ref").value();
-	string persoonId = child2.child("persoon").attribute("ref").value();
-	sqlw.addOrReplaceValue({{"id", id}, {"skiptoken", skiptoken}, {"bijgewerkt", bijgewerkt},
-		       {"updated", updated}, 
-		       {"gewicht", atoi(fields["gewicht"].c_str())},
-		       {"functie", fields["functie"]},
-		       {"van", fields["van"]},
-		       {"totEnMet", fields["totEnMet"]},
-		       {"fractieZetelId", fractieZetelId},
-		       {"persoonId", persoonId}
-	  },
-	  category);
-      }
-
-      else if(auto child = node.child("content").child("documentActor")) {
-	  
-	auto child2 = *node.child("content").begin();
-	map<string,string> fields;
-	for(const auto&c : child2) {
-	  fields[c.name()]= c.child_value();
-	}
-
-	string documentId = child.child("document").attribute("ref").value();
-	string persoonId = child.child("persoon").attribute("ref").value();
-	string fractieId = child.child("fractie").attribute("ref").value();
-	string commissieId = child.child("commissie").attribute("ref").value();
-	sqlw.addOrReplaceValue({{"id", id}, {"skiptoken", skiptoken}, {"bijgewerkt", bijgewerkt},
-		       {"updated", updated}, {"naam", fields["actorNaam"]},
-		       {"fractie", fields["actorFractie"]},
-		       {"functie", fields["functie"]},
-		       {"relatie", fields["relatie"]},
-		       {"documentId", documentId},
-		       {"commissieId", commissieId},
-		       {"persoonId", persoonId},
-		       {"fractieId", fractieId}},
-	  category);
-
-      }
-      else if(auto child = node.child("content").child("zaakActor")) {
-	auto child2 = *node.child("content").begin();
-
-	map<string,string> fields;
-	for(const auto&c : child2) {
-
-	  fields[c.name()]= c.child_value();
-	}
-
-	string zaakId = child.child("zaak").attribute("ref").value();
-	string persoonId = child.child("persoon").attribute("ref").value();
-	string fractieId = child.child("fractie").attribute("ref").value();
-	string commissieId = child.child("commissie").attribute("ref").value();
-	sqlw.addOrReplaceValue({{"id", id}, {"skiptoken", skiptoken}, {"bijgewerkt", bijgewerkt},
-		       {"updated", updated}, {"naam", fields["actorNaam"]},
-		       {"fractie", fields["actorFractie"]},
-		       {"functie", fields["functie"]},
-		       {"relatie", fields["relatie"]},
-		       {"afkorting", fields["actorAfkorting"]},
-		       {"zaakId", zaakId},
-		       {"persoonId", persoonId},
-		       {"commissieId", commissieId},
-		       {"fractieId", fractieId}},
-	  category);
-
-      }
-
-      else if(auto child = node.child("content").child("agendapunt")) {
-	  
-	auto child2 = *node.child("content").begin();
-	map<string,string> fields;
-	for(const auto&c : child2) {
-	  fields[c.name()]= c.child_value();
-	}
-	string activiteitId = child.child("activiteit").attribute("ref").value();
-	  
-	// activiteit='' nummer='2008P01291' onderwerp='Beantwoording vragen commissie over het evaluatierapport Belastinguitgaven op het terrein van de accijnzen' aanvangstijd='' eindtijd='' volgorde='40' rubriek='Stukken/brieven (als eerste) ondertekend door de staatssecretaris van Financiën' noot='De antwoorden op de door de commissie gestelde vragen zijn ontvangen op 15 juli 2008 (31200-IXB, nr. 35)' status='Vrijgegeven' 
-	  
-	sqlw.addOrReplaceValue({{"id", id}, {"skiptoken",skiptoken}, {"bijgewerkt", bijgewerkt},
-		       {"updated", updated}, {"nummer", fields["nummer"]},
-		       {"onderwerp", fields["onderwerp"]},
-		       {"aanvangstijd", fields["aanvangstijd"]},
-		       {"eindtijd", fields["eindtijd"]},
-		       {"volgorde", atoi(fields["volgorde"].c_str())},
-		       {"rubriek", fields["rubriek"]},
-		       {"noot", fields["noot"]},
-		       {"status", fields["status"]},
-		       {"activiteitId", activiteitId}
-	  },
-	  category);
-      }
-      else if(auto child = node.child("content").child("persoonGeschenk")) {
-	auto child2 = *node.child("content").begin();
-	map<string,string> fields;
-	for(const auto&c : child2) {
-	  fields[c.name()]= c.child_value();
-	}
-	string persoonId = child.child("persoon").attribute("ref").value();
-
-	sqlw.addOrReplaceValue({{"id", id}, {"skiptoken",skiptoken}, {"bijgewerkt", bijgewerkt},
-		       {"updated", updated}, {"omschrijving", fields["omschrijving"]},
-		       {"datum", fields["datum"]},
-		       {"gewicht", atoi(fields["gewicht"].c_str())},
-		       {"persoonId", persoonId}
-	  },
-	  category);
-
-      }
-      else if(auto child = node.child("content").child("documentVersie")) {
-
-	auto child2 = *node.child("content").begin();
-	map<string,string> fields;
-	for(const auto&c : child2) {
-	  fields[c.name()]= c.child_value();
-	}
-	string documentId = child.child("document").attribute("ref").value();
-
-	sqlw.addOrReplaceValue({{"id", id}, {"skiptoken",skiptoken}, {"bijgewerkt", bijgewerkt},
-		       {"updated", updated}, 
-		       {"datum", fields["datum"]},
-		       {"extensie", fields["extensie"]},
-		       {"externeidentifier", fields["externeidentifier"]},
-		       {"status", fields["status"]},
-		       {"versienummer", atoi(fields["versienummer"].c_str())},
-		       {"bestandsgrootte", atoi(fields["bestandsgrootte"].c_str())},
-		       {"documentId", documentId}
-	  },
-	  category);
-
-      }
-      else if(auto child = node.child("content").child("commissieContactinformatie")) {
-	auto child2 = *node.child("content").begin();
-	map<string,string> fields;
-	for(const auto&c : child2) {
-	  fields[c.name()]= c.child_value();
-	}
-	string commissieId = child.child("commissie").attribute("ref").value();
-	/*
-{"gewicht": 100, "soort": 100, "waarde": 100}
-Multi: {}
-Hasref: {"commissie"}
-	*/
-	
-	sqlw.addOrReplaceValue({{"id", id}, {"skiptoken",skiptoken}, {"bijgewerkt", bijgewerkt},
-		       {"updated", updated}, 
-		       {"gewicht", atoi(fields["gewicht"].c_str())},
-		       {"soort", fields["soort"]},
-		       {"waarde", fields["waarde"]},
-		       {"commissieId", commissieId}
-	  },
-	  category);
-
-      }
-      else if(auto child = node.child("content").child("commissieZetel")) {
-
-	auto child2 = *node.child("content").begin();
-	map<string,string> fields;
-	for(const auto&c : child2) {
-	  fields[c.name()]= c.child_value();
-	}
-	string commissieId = child.child("commissie").attribute("ref").value();
-	/*
-{"gewicht": 100}
-Multi: {}
-Hasref: {"commissie"}
-	*/
-	
-	sqlw.addOrReplaceValue({{"id", id}, {"skiptoken",skiptoken}, {"bijgewerkt", bijgewerkt},
-		       {"updated", updated}, 
-		       {"gewicht", atoi(fields["gewicht"].c_str())},
-		       {"commissieId", commissieId}
-	  },
-	  category);
-      }
-      else if(auto child = node.child("content").child("commissieZetelVastPersoon")) {
-
-	auto child2 = *node.child("content").begin();
-	map<string,string> fields;
-	for(const auto&c : child2) {
-	  fields[c.name()]= c.child_value();
-	}
-	string commissieZetelId = child.child("commissieZetel").attribute("ref").value();
-	string persoonId = child.child("persoon").attribute("ref").value();
-	/*
-	  CommissieZetelVastPersoon: 
-	  {"functie": 100, "totEnMet": 91, "van": 100}
-	  Multi: {}
-	  Hasref: {"commissieZetel", "persoon"}
-	*/
-	
-	sqlw.addOrReplaceValue({{"id", id}, {"skiptoken",skiptoken}, {"bijgewerkt", bijgewerkt},
-		       {"updated", updated},
-		       {"functie", fields["functie"]},
-		       {"totEnMet", fields["totEnMet"]},
-		       {"van", fields["van"]},		       
-		       {"gewicht", atoi(fields["gewicht"].c_str())},
-		       {"commissieZetelId", commissieZetelId},
-		       {"persoonId", persoonId}
-	  },
-	  category);
-      }
-      else if(auto child = node.child("content").child("commissieZetelVervangerPersoon")) {
-	auto child2 = *node.child("content").begin();
-	map<string,string> fields;
-	for(const auto&c : child2) {
-	  fields[c.name()]= c.child_value();
-	}
-	string commissieZetelId = child.child("commissieZetel").attribute("ref").value();
-	string persoonId = child.child("persoon").attribute("ref").value();
-	/*
-	  CommissieZetelVastPersoon: 
-	  {"functie": 100, "totEnMet": 91, "van": 100}
-	  Multi: {}
-	  Hasref: {"commissieZetel", "persoon"}
-	*/
-	
-	sqlw.addOrReplaceValue({{"id", id}, {"skiptoken",skiptoken}, {"bijgewerkt", bijgewerkt},
-		       {"updated", updated},
-		       {"functie", fields["functie"]},
-		       {"totEnMet", fields["totEnMet"]},
-		       {"van", fields["van"]},		       
-		       {"gewicht", atoi(fields["gewicht"].c_str())},
-		       {"commissieZetelId", commissieZetelId},
-		       {"persoonId", persoonId}
-	  },
-	  category);
-      }
-
-      else if(auto child = node.child("content").child("activiteitActor")) {
-	
-	auto child2 = *node.child("content").begin();
-	map<string,string> fields;
-	for(const auto&c : child2) {
-	  fields[c.name()]= c.child_value();
-	}
-
-	string persoonId = child.child("persoon").attribute("ref").value();
-	string activiteitId = child.child("activiteit").attribute("ref").value();
-	string fractieId = child.child("fractie").attribute("ref").value();
-	string commissieId = child.child("commissie").attribute("ref").value();
-
-	sqlw.addOrReplaceValue({{"id", id}, {"skiptoken",skiptoken}, {"bijgewerkt", bijgewerkt},
-		       {"updated", updated},
-		       {"functie", fields["functie"]},
-		       {"relatie", fields["relatie"]},
-		       {"naam", fields["actorNaam"]},
-		       {"fractie", fields["actorFractie"]},
-		       {"spreektijd", fields["spreektijd"]},
-		       {"volgorde", atoi(fields["volgorde"].c_str())},
-		       {"activiteitId", activiteitId},
-		       {"persoonId", persoonId},
-		       {"fractieId", fractieId},
-		       {"commissieId", commissieId}
-	  },
-	  category);
+    starts[category] = skiptoken;
+  }
 
+  exception_ptr writeerror;
+  atomic<bool> writefailed = false; // so we stop feeding the writer
+  uint64_t totentries = 0;
+  thread writer([&]() {
+    future<ConvChunk> fut;
+    string category;
+    int skiptoken = -1, numentries=0, deleterequests=0;
+    unordered_set<string> dels, adds;
+    unsigned int pending = 0;
+    DTime catdt;
+    /* We restart from the skiptoken of the last row of a category, so a transaction may only end
+       once all entries with that skiptoken are in. That is the case when we see the next skiptoken,
+       or when the category is done. This way a crash never leaves half a batch behind */
+    auto commit = [&]() {
+      if(pending) {
+        sqlw.query("commit");
+        pending = 0;
+      }
+    };
+    while(results.pop(fut)) {
+      if(writeerror)
+        continue; // keep draining
+      try {
+        ConvChunk chunk = fut.get();
+        if(chunk.category != category) {
+          category = chunk.category;
+          skiptoken = chunk.startskiptoken;
+          numentries = deleterequests = 0;
+          dels.clear();
+          adds.clear();
+          catdt.start();
+        }
+        for(auto& ce : chunk.entries) {
+          if(ce.hasSkiptoken && ce.skiptoken != skiptoken && pending >= batchsize)
+            commit();
+          if(!pending++)
+            sqlw.query("begin");
+          numentries++;
+          if(ce.hasSkiptoken)
+            skiptoken = ce.skiptoken;
+          const string& id = ce.id;
+          if(haveOV && (category == "Zaak" || category == "Document"))
+            sqlw.query("insert or ignore into openvragentodo values (?,?)", {id, category});
+          if(haveOV && category == "Document" && ce.deleted) // after this we can't see which zaken it belonged to anymore
+            sqlw.query("insert or ignore into openvragentodo select naar, 'Zaak' from link where van=?", {id});
+          if(ce.deleted) {
+            sqlw.query("delete from "+category+" where id=?", {id});
+            sqlw.query("delete from link where van=? or naar=?", {id, id});
+            deleterequests++;
+            dels.insert(id);
+            continue;
+          }
+          adds.insert(id);
+          for(auto& l : ce.links)
+            sqlw.addOrReplaceValue({{"skiptoken", skiptoken}, {"category", category}, {"van", id}, {"naar", l.first}, {"linkSoort", l.second}}, "link");
+          if(!ce.values.empty()) {
+            ce.values.insert(ce.values.begin(), {{"id", id}, {"skiptoken", skiptoken}});
+            sqlw.addOrReplaceValue(ce.values, category);
+          }
+        }
+        if(chunk.last) {
+          commit();
+          cout<<"Done with "<<category <<" - saw "<<numentries<<" entries, "<<adds.size()<<" uniqe adds, "<<dels.size()<<" unique delete requests"<<endl;
+          fmt::print("{} rows/sec\n", (int)(numentries / (catdt.lapUsec() / 1000000.0)));
+          totentries += numentries;
+        }
+      }
+      catch(...) {
+        writeerror = current_exception();
+        writefailed = true;
+        if(pending) {
+          try { sqlw.query("rollback"); } catch(...) {}
+        }
       }
-      else if(auto child = node.child("content").child("commissie")) {
-	  
-	auto child2 = *node.child("content").begin();
-	map<string,string> fields;
-	for(const auto&c : child2) {
-	  fields[c.name()]= c.child_value();
-	}
+    }
+  });
 
-	// nummer='62750' soort='Dienst Commissieondersteuning Internationaal en Ruimtelijk' afkorting='AM' naamNl='Vaste commissie voor Asiel en Migratie' naamEn='Asylum and Migration' naamWebNl='Asiel en Migratie' naamWebEn='Asylum and Migration' inhoudsopgave='Vaste commissies' datumActief='2024-07-02' datumInactief='' 
-	sqlw.addOrReplaceValue({{"id", id}, {"skiptoken",skiptoken}, {"bijgewerkt", bijgewerkt},
-		       {"updated", updated},
-		       {"nummer", atoi(fields["nummer"].c_str())},
-		       {"soort", fields["soort"]},
-		       {"afkorting", fields["afkorting"]},
-		       {"naam", fields["naamNl"]},
-		       {"naamEn", fields["naamEn"]},
-		       {"webNaam", fields["naamWebNl"]},
-		       {"inhoudsopgave", fields["inhoudsopgave"]},
-		       {"datumActief", fields["dactumActief"]},
-		       {"datumInactief", fields["dactumInactief"]}
-	  },
-	  category);
-      }
+  DTime dt;
+  dt.start();
+  for(const auto& category: categories) {
+    if(writefailed)
+      break;
+    int skiptoken = starts[category];
+    // we go through the entries one at a time, so memory use does not depend on how big the category is
+    constexpr size_t chunksize = 1000;
+    vector<RawEntry> raws;
+    auto submit = [&](bool last) {
+      if(writefailed) { // it would all get thrown away
+        raws.clear();
+        return;
+      }
+      packaged_task<ConvChunk()> task([&xc, category, skiptoken, last, raws = std::move(raws)]() mutable {
+        ConvChunk chunk;
+        chunk.category = category;
+        chunk.startskiptoken = skiptoken;
+        chunk.last = last;
+        chunk.entries.reserve(raws.size());
+        pugi::xml_document pnode;
+        string buf;
+        for(auto& re : raws) {
+          if(re.compressed) {
+            xc.decompress((const uint8_t*)re.data.data(), re.data.size(), buf);
+            chunk.entries.push_back(parseEntry(category, buf.data(), buf.size(), pnode));
+          }
+          else
+            chunk.entries.push_back(parseEntry(category, re.data.data(), re.data.size(), pnode));
+        }
+        return chunk;
+      });
+      raws.clear();
+      results.push(task.get_future());
+      tasks.push(std::move(task));
+    };
+    xmlreader.queryEach("select xml from "+category+" where skiptoken > ?", {skiptoken}, [&](sqlite3_stmt* stmt) {
+      if(writefailed)
+        return;
+      RawEntry re;
+      re.compressed = sqlite3_column_type(stmt, 0) == SQLITE_BLOB;
+      auto p = (const char*)(re.compressed ? sqlite3_column_blob(stmt, 0) : sqlite3_column_text(stmt, 0));
+      if(p)
+        re.data.assign(p, sqlite3_column_bytes(stmt, 0));
+      raws.push_back(std::move(re));
+      if(raws.size() == chunksize)
+        submit(false);
+    });
+    submit(true);
+  }
+  tasks.close();
+  for(auto& p : parsers)
+    p.join();
+  results.close();
+  writer.join();
+  if(writeerror) {
+    try {
+      rethrow_exception(writeerror);
     }
-    cout<<"Done with "<<category <<" - saw "<<numentries<<" entries, "<<adds.size()<<" uniqe adds, "<<dels.size()<<" unique delete requests"<<endl;
+    catch(std::exception& e) {
+      cout<<"Error converting: "<<e.what()<<endl;
+    }
+    return -1;
   }
+  double secs = dt.lapUsec() / 1000000.0;
+  fmt::print("Converted {} entries in {:.1f} seconds using {} parsing threads, {:.0f} entries/sec\n",
+             totentries, secs, numthreads, totentries / secs);
+
   cout<<"Render queries.. "<<endl;
-  sqlw.query("drop table if exists openvragen");
-  sqlw.query(R"(create table openvragen as select Zaak.id, Zaak.gestartOp, zaak.nummer, min(document.nummer) as docunummer, zaak.onderwerp, count(1) filter (where Document.soort='Schriftelijke vragen') as numvragen, count(1) filter (where Document.soort like 'Antwoord schriftelijke vragen%' or (Document.soort='Mededeling' and (document.onderwerp like '%ingetrokken%' or document.onderwerp like '%intrekken%'))) as numantwoorden, count(1) filter (where Document.soort like '%uitstel%') as numuitstel  from Zaak, Link, Document where Zaak.id = Link.naar and Document.id = Link.van and Zaak.gestartOp > '2019-09-09' group by 1, 3 having numvragen > 0 and numantwoorden==0 order by 2 desc)");
-  
+  auto ovquery = [](const std::string& extra) {
+    return R"(select Zaak.id, Zaak.gestartOp, zaak.nummer, min(document.nummer) as docunummer, zaak.onderwerp, count(1) filter (where Document.soort='Schriftelijke vragen') as numvragen, count(1) filter (where Document.soort like 'Antwoord schriftelijke vragen%' or (Document.soort='Mededeling' and (document.onderwerp like '%ingetrokken%' or document.onderwerp like '%intrekken%'))) as numantwoorden, count(1) filter (where Document.soort like '%uitstel%') as numuitstel  from Zaak, Link, Document where Zaak.id = Link.naar and Document.id = Link.van and Zaak.gestartOp > '2019-09-09' )" + extra + " group by 1, 3 having numvragen > 0 and numantwoorden==0 order by 2 desc";
+  };
+  // includes what earlier runs that died before getting here left behind
+  auto ret = sqlw.queryT("select count(1) filter (where category='Zaak') as zaken, count(1) filter (where category='Document') as docs from openvragentodo");
+  int64_t numzaken = get<int64_t>(ret[0]["zaken"]), numdocs = get<int64_t>(ret[0]["docs"]);
+  sqlw.query("begin");
+  if(!haveOV || numzaken + numdocs > 100000) {
+    sqlw.query("drop table if exists openvragen");
+    sqlw.query("create table openvragen as "+ovquery(""));
+  }
+  else if(numzaken + numdocs) {
+    sqlw.query("create temp table if not exists touchedzaken (id TEXT PRIMARY KEY)");
+    sqlw.query("delete from temp.touchedzaken");
+    sqlw.query("insert or ignore into temp.touchedzaken select id from openvragentodo where category='Zaak'");
+    sqlw.query("insert or ignore into temp.touchedzaken select naar from link, openvragentodo where category='Document' and van=openvragentodo.id");
+    sqlw.query("delete from openvragen where id in (select id from temp.touchedzaken)");
+    sqlw.query("insert into openvragen "+ovquery("and Zaak.id in (select id from temp.touchedzaken)"));
+  }
+  sqlw.query("delete from openvragentodo");
+  sqlw.query("commit");
+  fmt::print("Updated openvragen for {} zaken and {} documenten\n", numzaken, numdocs);
 }
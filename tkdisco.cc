@@ -5,6 +5,7 @@
 #include "httplib.h"
 #include "sqlwriter.hh"
 #include "pugixml.hpp"
+#include "xmlcompress.hh"
 
 using namespace std;
 int main(int argc, char** argv)
@@ -27,6 +28,7 @@ int main(int argc, char** argv)
       categories.push_back(argv[n]);
   }
   SQLiteWriter xmlstore("xml.sqlite3");
+  XMLCompressor xc(xmlstore);
   
   for(const auto& category: categories) {
     int skiptoken = -1;
@@ -37,7 +39,7 @@ int main(int argc, char** argv)
     set<string> multis, hasref;
     for(auto& exml : entries) {
       pugi::xml_document pnode;
-      if (!pnode.load_string( (get<string>(exml["xml"])).c_str())) {
+      if (!pnode.load_string( xc.getXML(exml["xml"]).c_str())) {
 	cout<<"Could not load"<<endl;
 	return -1;
       }
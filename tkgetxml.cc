@@ -1,11 +1,94 @@
 #include <fmt/format.h>
 #include <fmt/printf.h>
 #include <iostream>
+#include <thread>
+#include <atomic>
 #include "httplib.h"
 #include "sqlwriter.hh"
 #include "pugixml.hpp"
+#include "support.hh"
+#include "xmlcompress.hh"
+#include <argparse/argparse.hpp>
+#include "git_version.h"
 
 using namespace std;
+
+// saves the trip through an ostringstream
+struct StringWriter : pugi::xml_writer
+{
+  explicit StringWriter(std::string& s) : d_s(s) {}
+  void write(const void* data, size_t size) override
+  {
+    d_s.append((const char*)data, size);
+  }
+  std::string& d_s;
+};
+
+// finds the last rel="next" link without parsing the whole page, so we can fetch the next page
+// while this one is still being parsed
+static string findNextLink(const std::string& body)
+{
+  auto pos = body.rfind("rel=\"next\"");
+  if(pos == string::npos)
+    return "";
+  auto start = body.rfind('<', pos);
+  auto stop = body.find('>', pos);
+  if(start == string::npos || stop == string::npos)
+    return "";
+  string tag = body.substr(start, stop - start);
+  auto hpos = tag.find("href=\"");
+  if(hpos == string::npos)
+    return "";
+  hpos += 6;
+  string href = tag.substr(hpos, tag.find('"', hpos) - hpos);
+  for(auto apos = href.find("&amp;"); apos != string::npos; apos = href.find("&amp;", apos+1))
+    href.replace(apos, 5, "&");
+  return href;
+}
+
+// parses one page of a feed, skiptoken is updated as we encounter 'next' links. Returns the last 'next' link
+static string parsePage(const std::string& category, const std::string& body, int& skiptoken, FeedPage& page)
+{
+  string next;
+  pugi::xml_document doc;
+  if (!doc.load_string(body.c_str()))
+    throw runtime_error("Could not load XML for category "+category);
+
+  auto feed = doc.child("feed");
+  if(!feed)
+    throw runtime_error("No feed in XML for category "+category);
+
+  page.category = category;
+  for(const auto& node : feed.children("entry")) {
+    FeedEntry fe;
+    fe.id = node.child("title").child_value();
+    fe.updated = node.child("updated").child_value();
+    for (auto link : node.children("link")) {
+      if(link.attribute("rel").value() == string("enclosure")) {
+        fe.enclosure = link.attribute("href").value();
+      }
+      else if(link.attribute("rel").value() == string("next")) {
+        if(auto href = link.attribute("href")) {
+          next = href.value();
+          // https://gegevensmagazijn.tweedekamer.nl/SyncFeed/2.0/Feed?skiptoken=20127222&category=Document
+          if(next.find("https://gegevensmagazijn.tweedekamer.nl/SyncFeed/2.0/Feed"))
+            throw std::runtime_error("Unexpected next URL format "+next);
+          if(auto pos = next.find("skiptoken="); pos ==string::npos)
+            throw std::runtime_error("Could not find skiptoken in "+next);
+          else {
+            skiptoken = atoi(next.substr(pos+10).c_str());
+          }
+        }
+      }
+    }
+    fe.skiptoken = skiptoken;
+    StringWriter sw(fe.xml);
+    node.print(sw, "\t", pugi::format_raw);
+    page.entries.push_back(std::move(fe));
+  }
+  return next;
+}
+
 int main(int argc, char** argv)
 {
   vector<string> categories=
@@ -20,14 +103,30 @@ int main(int argc, char** argv)
 "PersoonReis", "Reservering", "Stemming", "Toezegging", "Vergadering",
 "Verslag", "Zaak", "ZaakActor", "Zaal"};
 
-  signal(SIGPIPE, SIG_IGN); // every TCP application needs this
-  
-  if(argc > 1) {
-    categories.clear();
-    for(int n = 1 ; n < argc; ++n)
-      categories.push_back(argv[n]);
+  argparse::ArgumentParser args("tkgetxml", GIT_VERSION);
+  args.add_argument("-j", "--parallel").help("number of categories to retrieve at the same time").default_value(4).scan<'i', int>();
+  args.add_argument("--batch").help("commit after at least this many entries, always on a page boundary").default_value(10000).scan<'i', int>();
+  args.add_argument("--compress").help("store entries zstd compressed, training a dictionary per category if needed").flag();
+  args.add_argument("--recompress").help("also compress the existing plain text entries").flag();
+  args.add_argument("categories").help("categories to retrieve, default is all of them").nargs(argparse::nargs_pattern::any).default_value(vector<string>());
+  try {
+    args.parse_args(argc, argv);
+  }
+  catch (const std::exception& err) {
+    cerr << err.what() << endl;
+    cerr << args;
+    return EXIT_FAILURE;
   }
-  SQLiteWriter sqlw("xml.sqlite3");
+  if(auto cats = args.get<vector<string>>("categories"); !cats.empty())
+    categories = cats;
+  int parallel = max(1, args.get<int>("--parallel"));
+  unsigned int batchsize = max(1, args.get<int>("--batch"));
+  bool compress = args.get<bool>("--compress") || args.get<bool>("--recompress");
+
+  signal(SIGPIPE, SIG_IGN); // every TCP application needs this
+
+  SQLiteWriter sqlw("xml.sqlite3", {}, SQLWFlag::NoTransactions);
+  map<string, pair<string, int>> starts; // next URL and skiptoken to continue from
   for(const auto& category: categories) {
     sqlw.query("create table if not exists "+category+" (skiptoken INT)");
     sqlw.query("create index if not exists "+category+"skipidx on "+category+"(skiptoken)");
@@ -35,7 +134,7 @@ int main(int argc, char** argv)
     int skiptoken = -1;
     try {
       auto ret = sqlw.queryT("select skiptoken from "+category+" order by rowid desc limit 1");
-      if(!ret.empty()) { 
+      if(!ret.empty()) {
 	skiptoken = get<int64_t>(ret[0]["skiptoken"]);
         next = fmt::format("https://gegevensmagazijn.tweedekamer.nl/SyncFeed/2.0/Feed?skiptoken={}&category={}", skiptoken, category);
       }
@@ -46,64 +145,132 @@ int main(int argc, char** argv)
     catch(std::exception& e) {
       fmt::print("Could not get a 'next' from database for category {}, starting from scratch\n", category);
     }
-    int entries=0;  
-
-    while(!next.empty()) {
-      httplib::Client cli("https://gegevensmagazijn.tweedekamer.nl");
-      cli.set_connection_timeout(10, 0); 
-      cli.set_read_timeout(10, 0); 
-      cli.set_write_timeout(10, 0); 
-      
-      fmt::print("Retrieving from {}\n", next);
-      auto res = cli.Get(next);
-
-      if(!res) {
-	auto err = res.error();
-	throw runtime_error("Oops retrieving from "+next+" -> "+httplib::to_string(err));
+    starts[category] = {next, skiptoken};
+  }
+
+  XMLCompressor xc(sqlw);
+  if(compress) {
+    for(const auto& category: categories) {
+      if(xc.haveDict(category))
+        continue;
+      if(xc.train(sqlw, category))
+        fmt::print("Trained compression dictionary for {}\n", category);
+      else
+        fmt::print("Not enough entries to train a dictionary for {}, storing as plain text for now\n", category);
+    }
+  }
+  if(args.get<bool>("--recompress")) {
+    for(const auto& category: categories) {
+      if(!xc.haveDict(category))
+        continue;
+      int64_t rowid = 0, count = 0;
+      for(;;) {
+        auto rows = sqlw.queryT("select rowid, xml from "+category+" where rowid > ? and typeof(xml)='text' order by rowid limit 10000", {rowid});
+        if(rows.empty())
+          break;
+        sqlw.query("begin");
+        for(auto& r : rows) {
+          rowid = get<int64_t>(r["rowid"]);
+          sqlw.queryT("update "+category+" set xml=? where rowid=?", {xc.compress(category, get<string>(r["xml"])), rowid});
+        }
+        sqlw.query("commit");
+        count += rows.size();
       }
-      
-      next.clear();
-      pugi::xml_document doc;
-      if (!doc.load_string(res->body.c_str())) {
-	cout<<"Could not load XML"<<endl;
-	return -1;
+      fmt::print("Compressed {} existing entries of {}\n", count, category);
+    }
+    fmt::print("Run 'vacuum' on xml.sqlite3 to actually reclaim the space\n");
+  }
+
+  // fetch -> parse -> write. There is a fetcher and a parser for every category we are working on,
+  // and one writer for all of them since SQLite only does one writer anyway
+  BoundedQueue<FeedPage> pages(4*parallel);
+  atomic<bool> failed = false;
+
+  // we do our own transactions, and only commit on page boundaries. The last entry of a page carries the
+  // skiptoken we restart from, so that way it is always committed together with the entries it covers
+  thread writer([&]() {
+    storeFeedPages(sqlw, pages, batchsize, failed);
+  });
+
+  auto doCategory = [&](const std::string& category) {
+    BoundedQueue<string> bodies(2);
+    exception_ptr fetcherror;
+    thread fetcher([&]() {
+      try {
+        httplib::Client cli("https://gegevensmagazijn.tweedekamer.nl");
+        cli.set_connection_timeout(10, 0);
+        cli.set_read_timeout(10, 0);
+        cli.set_write_timeout(10, 0);
+        cli.set_keep_alive(true);
+        for(string next = starts.at(category).first; !next.empty() && !failed; ) {
+          fmt::print("Retrieving from {}\n", next);
+          auto res = cli.Get(next);
+          if(!res) {
+            auto err = res.error();
+            throw runtime_error("Oops retrieving from "+next+" -> "+httplib::to_string(err));
+          }
+          next = findNextLink(res->body);
+          if(!bodies.push(std::move(res->body)))
+            break;
+        }
       }
-      
-      auto feed = doc.child("feed");
-      if(!feed) {
-	cout<<"No feed in XML at "<<next<<"\n";
-	return -1;
+      catch(...) {
+        fetcherror = current_exception();
       }
-      
-      for(const auto& node : feed.children("entry")) {
-	string id = node.child("title").child_value();
-	string updated = node.child("updated").child_value();
-	string enclosure;
-	entries++;
-	for (auto link : node.children("link")) {
-	  if(link.attribute("rel").value() == string("enclosure")) {
-	    enclosure = link.attribute("href").value();
-	  }
-	  else if(link.attribute("rel").value() == string("next")) {
-	    if(auto href = link.attribute("href")) {
-	      next = href.value();
-	      // https://gegevensmagazijn.tweedekamer.nl/SyncFeed/2.0/Feed?skiptoken=20127222&category=Document
-	      if(next.find("https://gegevensmagazijn.tweedekamer.nl/SyncFeed/2.0/Feed"))
-		throw std::runtime_error("Unexpected next URL format "+next);
-	      if(auto pos = next.find("skiptoken="); pos ==string::npos)
-		throw std::runtime_error("Could not find skiptoken in "+next);
-	      else {
-		skiptoken = atoi(next.substr(pos+10).c_str());
-	      }
-	    }
-	  }
-	}
-	ostringstream xml;
-	node.print(xml, "\t", pugi::format_raw);
-	sqlw.addValue({{"category", category},{"id", id}, {"skiptoken", skiptoken}, {"enclosure", enclosure}, {"updated", updated}, {"xml", xml.str()}}, category);
+      bodies.close();
+    });
+
+    DTime dt;
+    dt.start();
+    int entries = 0;
+    try {
+      int skiptoken = starts.at(category).second;
+      string body;
+      while(bodies.pop(body)) {
+        FeedPage page;
+        string next = parsePage(category, body, skiptoken, page);
+        if(next != findNextLink(body))
+          throw runtime_error("Parsed next link '"+next+"' differs from scanned one for "+category);
+        if(compress && xc.haveDict(category)) {
+          for(auto& fe : page.entries)
+            fe.zxml = xc.compress(category, fe.xml);
+        }
+        entries += page.entries.size();
+        pages.push(std::move(page));
       }
-      usleep(100000);
     }
-    cout<<"Done - saw "<<entries<<" new entries"<<endl;
+    catch(std::exception& e) {
+      fmt::print("Error processing {}: {}\n", category, e.what());
+      failed = true;
+      bodies.close();
+    }
+    fetcher.join();
+    if(fetcherror) {
+      try {
+        rethrow_exception(fetcherror);
+      }
+      catch(std::exception& e) {
+        fmt::print("Error fetching {}: {}\n", category, e.what());
+      }
+      failed = true;
+    }
+    double secs = dt.lapUsec() / 1000000.0;
+    fmt::print("Done with {} - saw {} new entries in {:.1f} seconds, {:.1f} entries/sec\n",
+               category, entries, secs, entries / secs);
+  };
+
+  atomic<size_t> ctr = 0;
+  vector<thread> workers;
+  for(int n = 0; n < parallel; ++n) {
+    workers.emplace_back([&]() {
+      for(size_t i = ctr++; i < categories.size(); i = ctr++)
+        doCategory(categories[i]);
+    });
   }
+  for(auto& w : workers)
+    w.join();
+  pages.close();
+  writer.join();
+
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
 }
@@ -6,101 +6,183 @@
 #include "sqlwriter.hh"
 #include <atomic>
 #include "support.hh"
+#include "textextract.hh"
 #include <unordered_set>
+#include <thread>
+#include <argparse/argparse.hpp>
+#include "git_version.h"
 
 using namespace std;
 
-static string textFromFile(const std::string& fname)
+// what an extraction worker hands to the writer
+struct ExtractedDoc
 {
-  string command;
-  if(isPDF(fname)) {
-    command = string("pdftotext -q -nopgbrk - < '") + fname + "' -";
-  }
-  else if(isDocx(fname)) {
-    command = string("pandoc -f docx '"+fname+"' -t plain");
+  size_t n; // in wantAll
+  string text;
+  bool fresh; // not from the text cache, so it should go in there
+};
+
+int main(int argc, char** argv)
+{
+  argparse::ArgumentParser args("tkindex", GIT_VERSION);
+  args.add_argument("-j", "--threads").help("number of text extraction threads").default_value((int)max(1U, thread::hardware_concurrency())).scan<'i', int>();
+  args.add_argument("--batch").help("number of documents per index transaction").default_value(1000).scan<'i', int>();
+  args.add_argument("--optimize").help("merge the whole FTS index into one b-tree at the end, slow on a big index").flag();
+  args.add_argument("--merge").help("do this many pages of incremental FTS merge work at the end").default_value(0).scan<'i', int>();
+  args.add_argument("--full").help("look at all documents and check the whole index against the enclosures, instead of only what changed since the last run").flag();
+  args.add_argument("--textcache").help("where we keep the text we extracted, for reindexing").default_value(string("textcache.sqlite3"));
+  args.add_argument("--contentless").help("when creating a new index, leave the text out of it and keep it only in the text cache").flag();
+  args.add_argument("index").help("index database to update").default_value(string("tkindex.sqlite3"));
+  try {
+    args.parse_args(argc, argv);
   }
-  else if(isXML(fname)) {
-    command = string("xmlstarlet tr tk.xslt < '"+fname+"' | sed 's:<[^>]*>: :g'");
+  catch (const std::exception& err) {
+    cerr << err.what() << endl;
+    cerr << args;
+    return EXIT_FAILURE;
   }
-  else if(isDoc(fname))
-    command = "catdoc - < '" + fname +"'";
-  else if(isRtf(fname))
-    command = string("pandoc -f rtf '"+fname+"' -t plain");
+  int numthreads = max(1, args.get<int>("--threads"));
+  unsigned int batchsize = max(1, args.get<int>("--batch"));
+
+  bool full = args.get<bool>("--full");
+  string idxfname = args.get<string>("index");
+  // we do our own transactions, see the writer below
+  SQLiteWriter sqlw(idxfname, {{"indexed", {{"uuid", "PRIMARY KEY"}}}}, SQLWFlag::NoTransactions);
+
+  /* A contentless index only has the terms, which makes it a lot smaller. The rest lives in 'indexed',
+     docsearch.rowid = indexed.id, and tkserv makes its snippets from the text cache. Removing a document
+     from a contentless table means telling FTS5 what we inserted, which we get from the text cache too */
+  bool contentless;
+  if(auto ret = sqlw.queryT("select sql from sqlite_master where name='docsearch'"); !ret.empty())
+    contentless = get<string>(ret[0]["sql"]).find("content=''") != string::npos;
   else
-    return "";
-  
-  string ret;
-  FILE* pfp = popen(command.c_str(), "r");
-  if(!pfp)
-    throw runtime_error("Unable to perform pdftotext: "+string(strerror(errno)));
-  shared_ptr<FILE> fp(pfp, pclose);
-  
-  char buffer[4096];
-  
-  for(;;) {
-    int len = fread(buffer, 1, sizeof(buffer), fp.get());
-    if(!len)
-      break;
-    ret.append(buffer, len);
-  }
-  if(ferror(fp.get()))
-    throw runtime_error("Unable to perform pdftotext: "+string(strerror(errno)));
-  return ret;
-}
+    contentless = args.get<bool>("--contentless");
+  if(contentless != args.get<bool>("--contentless"))
+    fmt::print("Existing index {} is {}contentless, keeping it that way\n", idxfname, contentless ? "" : "not ");
 
+  if(contentless) {
+    sqlw.queryT(R"(
+CREATE VIRTUAL TABLE IF NOT EXISTS docsearch USING fts5(onderwerp, titel, tekst, content='', tokenize="unicode61 tokenchars '_'")
+)");
+    sqlw.queryT("create table if not exists indexed (id INTEGER PRIMARY KEY, uuid TEXT, contentLength INT, datum TEXT, category TEXT, onderwerp TEXT, titel TEXT, hash TEXT)");
+  }
+  else {
+    sqlw.queryT(R"(
+CREATE VIRTUAL TABLE IF NOT EXISTS docsearch USING fts5(onderwerp, titel, tekst, contentLength UNINDEXED, uuid UNINDEXED, datum UNINDEXED, category UNINDEXED,  tokenize="unicode61 tokenchars '_'")
+)");
+    // IF THIS GETS OUT OF SYNC:
+    sqlw.queryT("create table if not exists indexed as select datum,uuid,contentLength,category from docsearch");
+  }
+  sqlw.queryT("create unique index if not exists uuididx on indexed(uuid)");
+  // how far we got in tk.sqlite3, tkconv gives every changed row a new and higher skiptoken
+  sqlw.query("create table if not exists indexhwm (category TEXT PRIMARY KEY, latest INT)");
+  // documents we wanted but had no enclosure for yet, tried again every run
+  sqlw.query("create table if not exists indexpending (uuid TEXT PRIMARY KEY)");
 
-int main(int argc, char** argv)
-{
-  SQLiteWriter todo("tk.sqlite3");
-  string limit="2008-01-01";
-  fmt::print("Getting docs since {}\n", limit);
-  auto wantDocs = todo.queryT("select id,titel,onderwerp,datum,'Document' as category, contentLength from Document where datum > ?", {limit});
+  SQLiteReader todo("tk.sqlite3", {"ATTACH DATABASE '"+idxfname+"' as idx"});
+  map<string, int64_t> hwms, newhwms;
+  for(string category : {"Document", "Verslag"}) {
+    auto ret = todo.queryT("select max(skiptoken) as hwm from "+category);
+    auto hwm = get_if<int64_t>(&ret[0]["hwm"]);
+    newhwms[category] = hwm ? *hwm : -1;
+    ret = sqlw.queryT("select latest from indexhwm where category=?", {category});
+    if(ret.empty()) {
+      if(!full)
+        fmt::print("No high water mark for {} yet, doing a full run\n", category);
+      full = true;
+    }
+    else
+      hwms[category] = get<int64_t>(ret[0]["latest"]);
+  }
 
+  string limit="2008-01-01";
+  decltype(todo.queryT("")) wantDocs, alleVerslagen;
+  if(full) {
+    fmt::print("Getting docs since {}\n", limit);
+    wantDocs = todo.queryT("select id,titel,onderwerp,datum,'Document' as category, contentLength from Document where datum > ?", {limit});
+  }
+  else {
+    fmt::print("Getting docs since {} that changed beyond skiptoken {}, or that we are waiting for\n", limit, hwms["Document"]);
+    wantDocs = todo.queryT("select id,titel,onderwerp,datum,'Document' as category, contentLength from Document where datum > ? and ((skiptoken > ? and skiptoken <= ?) or id in (select uuid from idx.indexpending))",
+                           {limit, hwms["Document"], newhwms["Document"]});
+  }
   fmt::print("There are {} documents we'd like to index\n", wantDocs.size());
 
   // query voor verslagen is ingewikkeld want we willen alleen de nieuwste versie indexeren
   // en sterker nog alle oude versies wissen
-  fmt::print("Getting verslagen since {}\n", limit);
-  auto alleVerslagen = todo.queryT("select Verslag.id as id, vergadering.id as vergaderingid,datum, vergadering.titel as onderwerp, '' as titel, 'Verslag' as category, contentLength from Verslag,Vergadering where Verslag.vergaderingId=Vergadering.id and datum > ? order by datum desc, verslag.updated desc", {limit});
+  string verslagq = "select Verslag.id as id, vergadering.id as vergaderingid,datum, vergadering.titel as onderwerp, '' as titel, 'Verslag' as category, contentLength from Verslag,Vergadering where Verslag.vergaderingId=Vergadering.id and datum > ?";
+  if(full) {
+    fmt::print("Getting verslagen since {}\n", limit);
+    alleVerslagen = todo.queryT(verslagq + " order by datum desc, verslag.updated desc", {limit});
+  }
+  else {
+    // all versions for the vergaderingen that got a new one
+    fmt::print("Getting verslagen since {} for vergaderingen that changed beyond skiptoken {}\n", limit, hwms["Verslag"]);
+    alleVerslagen = todo.queryT(verslagq + " and Verslag.vergaderingId in (select vergaderingId from Verslag where (skiptoken > ? and skiptoken <= ?) or id in (select uuid from idx.indexpending)) order by datum desc, verslag.updated desc",
+                                {limit, hwms["Verslag"], newhwms["Verslag"]});
+  }
 
   set<string> seenvergadering;
   decltype(alleVerslagen) wantVerslagen;
+  vector<string> oldVerslagen;
   for(auto& v: alleVerslagen) {
     string vid = get<string>(v["vergaderingid"]);
-    if(seenvergadering.count(vid)) 
+    if(seenvergadering.count(vid)) {
+      oldVerslagen.push_back(get<string>(v["id"]));
       continue;
+    }
     wantVerslagen.push_back(v);
     seenvergadering.insert(vid);
   }
   fmt::print("Would like to index {} most recent verslagen\n", wantVerslagen.size());
 
-  string idxfname = argc<2 ? "tkindex.sqlite3" : argv[1];
-  SQLiteWriter sqlw(idxfname, {{"indexed", {{"uuid", "PRIMARY KEY"}}}});
+  decltype(wantDocs) wantAll = wantDocs;
 
-  sqlw.queryT(R"(
-CREATE VIRTUAL TABLE IF NOT EXISTS docsearch USING fts5(onderwerp, titel, tekst, contentLength UNINDEXED, uuid UNINDEXED, datum UNINDEXED, category UNINDEXED,  tokenize="unicode61 tokenchars '_'")
-)");
+  for(const auto& wv : wantVerslagen)
+    wantAll.push_back(wv);
 
-  // IF THIS GETS OUT OF SYNC:
-  sqlw.queryT("create table if not exists indexed as select datum,uuid,contentLength,category from docsearch");
-  sqlw.queryT("create unique index if not exists uuididx on indexed(uuid)");
-  
-  fmt::print("Retrieving already indexed document uuids..");
-  cout.flush();
-  auto already = sqlw.queryT("select uuid,contentLength from indexed");
   map<string, int64_t> skipids; // ordering actually gets us locality of reference below
-  for(auto& a : already) {
-    skipids[get<string>(a["uuid"])] = get<int64_t>(a["contentLength"]);
+  if(full) {
+    fmt::print("Retrieving already indexed document uuids..");
+    cout.flush();
+    auto already = sqlw.queryT("select uuid,contentLength from indexed");
+    for(auto& a : already) {
+      skipids[get<string>(a["uuid"])] = get<int64_t>(a["contentLength"]);
+    }
+    fmt::print(" got {}\n", skipids.size());
+  }
+  else {
+    for(auto& w : wantAll) {
+      auto ret = sqlw.queryT("select contentLength from indexed where uuid=?", {get<string>(w["id"])});
+      if(!ret.empty())
+        skipids[get<string>(w["id"])] = get<int64_t>(ret[0]["contentLength"]);
+    }
+    fmt::print("{} of these are indexed already\n", skipids.size());
   }
-  fmt::print(" got {}\n", skipids.size());
   unordered_set<string> dropids, reindex;
+
+  EnclosureManifest manifest;
+  manifest.bootstrap("docs");
+  unordered_map<string, EnclosureManifest::Entry> ondisk;
+  if(full)
+    ondisk = manifest.getAll("docs");
+  else {
+    for(auto& w : wantAll)
+      if(auto e = manifest.get(get<string>(w["id"])))
+        ondisk.emplace(get<string>(w["id"]), *e);
+  }
+  fmt::print("Manifest knows about {} document enclosures\n", ondisk.size());
+  auto present = [&ondisk](const std::string& id) {
+    auto iter = ondisk.find(id);
+    return iter != ondisk.end() && iter->second.size > 0;
+  };
   
   for(const auto& si : skipids) {
-    if(!isPresentNonEmpty(si.first)) {
+    if(!present(si.first)) {
       fmt::print("We miss document enclosure for indexed document with id {}\n", si.first);
       dropids.insert(si.first); 
     }
-    else if(!isPresentRightSize(si.first, si.second)) {
+    else if(ondisk.find(si.first)->second.size != si.second) {
       fmt::print("Document enclosure for indexed document with id {} is wrong size, reindexing\n", si.first);
       reindex.insert(si.first); 
     }
@@ -108,30 +190,159 @@ CREATE VIRTUAL TABLE IF NOT EXISTS docsearch USING fts5(onderwerp, titel, tekst,
   fmt::print("{} entries that are indexed have no file enclosure present\n", dropids.size());
   fmt::print("{} entries that are indexed have incorrectly sized enclosure, reindexing\n", reindex.size());
 
+  // pdftotext is slow, so a reindex with a different FTS configuration should not have to do it again
+  TextCache textcache(args.get<string>("--textcache"), numthreads);
+
+  // returns false if id wasn't in the index
+  auto unindex = [&](const std::string& id) {
+    if(!contentless) {
+      // docsearch has no index on uuid, so only delete what is really there
+      if(sqlw.queryT("select 1 from indexed where uuid=?", {id}).empty())
+        return false;
+      sqlw.queryT("delete from docsearch where uuid=?", {id});
+      sqlw.queryT("delete from indexed where uuid=?", {id});
+      return true;
+    }
+    auto ret = sqlw.queryT("select id, onderwerp, titel, hash from indexed where uuid=?", {id});
+    if(ret.empty())
+      return false;
+    auto& row = ret[0];
+    // the text has to be exactly what we inserted, or we'd remove the wrong terms
+    if(auto text = textcache.get(id, get<string>(row["hash"])))
+      sqlw.queryT("insert into docsearch(docsearch, rowid, onderwerp, titel, tekst) values('delete', ?, ?, ?, ?)",
+                  {get<int64_t>(row["id"]), get<string>(row["onderwerp"]), get<string>(row["titel"]), *text});
+    else
+      fmt::print("No cached text for {}, its terms stay behind in the index\n", id);
+    sqlw.queryT("delete from indexed where id=?", {get<int64_t>(row["id"])});
+    return true;
+  };
+
+  sqlw.query("begin");
   for(const auto& di : dropids) {
     fmt::print("Removing absent {} from index\n", di);
-    sqlw.queryT("delete from docsearch where uuid=?", {di});
-    sqlw.queryT("delete from indexed where uuid=?", {di});
+    unindex(di);
   }
   for(const auto& di : reindex) {
     fmt::print("Removing wrongly sized {} from index\n", di);
-    sqlw.queryT("delete from docsearch where uuid=?", {di});
-    sqlw.queryT("delete from indexed where uuid=?", {di});
+    unindex(di);
     skipids.erase(di);
   }
+  int oldremoved = 0;
+  for(const auto& ov : oldVerslagen) {
+    if(unindex(ov))
+      oldremoved++;
+  }
+  sqlw.query("commit");
+  fmt::print("Removed {} older versions of verslagen from the index\n", oldremoved);
 
   fmt::print("{} documents are already indexed & will be skipped\n",
 	     skipids.size());
-
-  decltype(wantDocs) wantAll = wantDocs;
-
-  for(const auto& wv : wantVerslagen)
-    wantAll.push_back(wv);
   
+  // extraction workers -> queue -> a single writer that does the FTS inserts in big transactions
+  BoundedQueue<ExtractedDoc> extracted(4*numthreads);
   atomic<size_t> ctr = 0;
+  atomic<int> skipped=0, notpresent=0, wrong=0, indexed=0, extractedDocs=0, cachehits=0;
+  atomic<uint64_t> textbytes = 0;
+  bool failed = false;
+  uint64_t writeusec = 0;
+  unsigned int commits = 0;
+  std::mutex waitinglock;
+  vector<string> waiting; // for their enclosure, or for another try
+
+  // if the enclosure is not the size tk.sqlite3 says, tkpull is still behind on a new version. We index
+  // (or keep) what we have, but come back for it, the high water mark won't bring us here again
+  int late = 0;
+  for(auto& w : wantAll) {
+    auto iter = ondisk.find(get<string>(w["id"]));
+    auto cl = get_if<int64_t>(&w["contentLength"]);
+    if(iter != ondisk.end() && iter->second.size > 0 && cl && *cl != iter->second.size) {
+      waiting.push_back(get<string>(w["id"]));
+      late++;
+    }
+  }
+  fmt::print("{} documents have an enclosure that does not match their contentLength yet\n", late);
+
+  thread writer([&]() {
+    ExtractedDoc ed;
+    unsigned int pending = 0;
+    vector<pair<string, string>> fresh; // id, hash we put in the text cache this batch
+    DTime dt;
+    /* The text cache commits first: text nobody refers to is harmless, but terms in a contentless index
+       whose text is gone can never be deleted. Older texts only go once the index stopped using them */
+    auto commit = [&]() {
+      textcache.commit();
+      sqlw.query("commit");
+      if(!fresh.empty()) {
+        textcache.begin();
+        for(const auto& f : fresh)
+          textcache.prune(f.first, f.second);
+        textcache.commit();
+        fresh.clear();
+      }
+      commits++;
+      pending = 0;
+    };
+    while(extracted.pop(ed)) {
+      if(failed)
+        continue; // keep draining so the workers don't block on us
+      dt.start();
+      try {
+        if(!pending) {
+          sqlw.query("begin");
+          textcache.begin();
+        }
+        auto& row = wantAll[ed.n];
+        string titel;
+        if(auto t = get_if<string>(&row["titel"]))
+          titel = *t;
+        const string& hash = ondisk.find(get<string>(row["id"]))->second.hash;
+
+        if(contentless) {
+          unindex(get<string>(row["id"]));
+          sqlw.queryT("insert into indexed (uuid, contentLength, datum, category, onderwerp, titel, hash) values (?,?,?,?,?,?,?)", {
+              get<string>(row["id"]), get<int64_t>(row["contentLength"]), get<string>(row["datum"]), get<string>(row["category"]),
+              get<string>(row["onderwerp"]), titel, hash});
+          auto ret = sqlw.queryT("select last_insert_rowid() as id");
+          sqlw.queryT("insert into docsearch (rowid, onderwerp, titel, tekst) values (?,?,?,?)", {
+              get<int64_t>(ret[0]["id"]), get<string>(row["onderwerp"]), titel, ed.text});
+        }
+        else {
+          sqlw.queryT("insert into docsearch values (?,?,?,?,?,?,?)", {
+              get<string>(row["onderwerp"]),
+              titel,
+              ed.text,
+              get<int64_t>(row["contentLength"]),
+              get<string>(row["id"]), get<string>(row["datum"]), get<string>(row["category"])  });
+
+          sqlw.addOrReplaceValue({{"uuid", get<string>(row["id"])}, {"contentLength",  get<int64_t>(row["contentLength"])}, {"datum", get<string>(row["datum"])},
+                                  {"category", get<string>(row["category"])  }}, "indexed");
+        }
+        sqlw.queryT("delete from indexpending where uuid=?", {get<string>(row["id"])});
+        // a contentless index can't do without
+        if(ed.fresh) {
+          textcache.put(get<string>(row["id"]), hash, ed.text);
+          fresh.push_back({get<string>(row["id"]), hash});
+        }
+        indexed++;
+        if(++pending >= batchsize)
+          commit();
+      }
+      catch(std::exception& e) {
+        fmt::print("Error storing {} in index: {}\n", get<string>(wantAll[ed.n]["id"]), e.what());
+        failed = true;
+        extracted.close(); // so the workers stop extracting text nobody will store
+        try { sqlw.query("rollback"); } catch(...) {}
+        try { textcache.rollback(); } catch(...) {}
+      }
+      writeusec += dt.lapUsec();
+    }
+    if(pending && !failed) {
+      dt.start();
+      commit();
+      writeusec += dt.lapUsec();
+    }
+  });
 
-  std::mutex m;
-  atomic<int> skipped=0, notpresent=0, wrong=0, indexed=0;
   auto worker = [&]() {
     for(unsigned int n = ctr++; n < wantAll.size(); n = ctr++) {
       string id = get<string>(wantAll[n]["id"]);
@@ -141,61 +352,112 @@ CREATE VIRTUAL TABLE IF NOT EXISTS docsearch USING fts5(onderwerp, titel, tekst,
 	continue;
       }
       string fname = makePathForId(id);
-      if(!isPresentNonEmpty(id)) {
+      if(!present(id)) {
 	//	fmt::print("{} is not present\n", id);
 	notpresent++;
+	lock_guard<mutex> l(waitinglock);
+	waiting.push_back(id);
 	continue;
       }
-      string text = textFromFile(fname);
+      // the manifest sniffed the type when the file was stored
+      const auto& entry = ondisk.find(id)->second;
+      FileType type = entry.type;
+      string text;
+      try {
+        if(auto cached = textcache.get(id, entry.hash)) {
+          cachehits++;
+          textbytes += cached->size();
+          extractedDocs++;
+          if(!extracted.push({n, std::move(*cached), false}))
+            break;
+          continue;
+        }
+        text = textFromFile(fname, type);
       
-      if(text.empty()) {
-	if(isPresentNonEmpty(id, "improvdocs")) {
-	  string impfname = makePathForId(id, "improvdocs");
+        if(text.empty()) {
+          if(isPresentNonEmpty(id, "improvdocs")) {
+            string impfname = makePathForId(id, "improvdocs");
 	  
-	  text = textFromFile(impfname);
-	  if(!text.empty()) {
-	    fmt::print("{} did work using improvdocs overlay!\n", id);
-	  }
-	  else {
-	    fmt::print("{} is not a file we can deal with {}\n", fname, isPDF(impfname) ? "PDF" : "");
-	    wrong++;
-	    continue;
-	  }
-	}
-	else {
-	  fmt::print("{} is not a file we can deal with {}\n", fname, isPDF(fname) ? "PDF" : "");
-	  wrong++;
-	  continue;
-	}
+            FileType imptype = sniffFileType(impfname);
+            text = textFromFile(impfname, imptype);
+            if(!text.empty()) {
+              fmt::print("{} did work using improvdocs overlay!\n", id);
+            }
+            else {
+              fmt::print("{} is not a file we can deal with {}\n", fname, imptype == FileType::PDF ? "PDF" : "");
+              wrong++;
+              continue;
+            }
+          }
+          else {
+            fmt::print("{} is not a file we can deal with {}\n", fname, type == FileType::PDF ? "PDF" : "");
+            wrong++;
+            continue;
+          }
+        }
       }
-
-      lock_guard<mutex> p(m);
-      string titel;
-      try {
-	titel = 	  get<string>(wantAll[n]["titel"]);
-      } catch(...){}
-      
-      sqlw.queryT("insert into docsearch values (?,?,?,?,?,?,?)", {
-	  get<string>(wantAll[n]["onderwerp"]),
-	  titel,
-	  text,
-	  get<int64_t>(wantAll[n]["contentLength"]),
-	  id, get<string>(wantAll[n]["datum"]), get<string>(wantAll[n]["category"])  });
-
-      sqlw.addOrReplaceValue({{"uuid", id}, {"contentLength",  get<int64_t>(wantAll[n]["contentLength"])}, {"datum", get<string>(wantAll[n]["datum"])},
-		     {"category", get<string>(wantAll[n]["category"])  }}, "indexed");
-	    
-      indexed++;
+      catch(std::exception& e) {
+        fmt::print("Error extracting text from {}: {}\n", fname, e.what());
+        wrong++;
+        lock_guard<mutex> l(waitinglock);
+        waiting.push_back(id); // might work next time, pdftotext could have been killed
+        continue;
+      }
+      textbytes += text.size();
+      extractedDocs++;
+      if(!extracted.push({n, std::move(text), true}))
+        break;
     }
   };
 
+  DTime dt;
+  dt.start();
   vector<thread> workers;
-  for(int n=0; n < 8; ++n)  // number of threads
+  for(int n=0; n < numthreads; ++n)
     workers.emplace_back(worker);
   
   for(auto& w : workers)
     w.join();
+  double extractsecs = dt.lapUsec() / 1000000.0;
+  extracted.close();
+  writer.join();
+  double totalsecs = extractsecs + dt.lapUsec() / 1000000.0;
+
+  fmt::print("Extraction: {} documents ({} from the text cache), {:.1f} MB of text in {:.1f} seconds with {} threads, {:.1f} docs/sec\n",
+             extractedDocs.load(), cachehits.load(), textbytes / 1000000.0, extractsecs, numthreads, extractedDocs / extractsecs);
+  fmt::print("Index writer: {} documents in {} transactions, busy for {:.1f} of {:.1f} seconds, {:.1f} docs/sec while busy\n",
+             (int)indexed, commits, writeusec / 1000000.0, totalsecs, writeusec ? indexed * 1000000.0 / writeusec : 0.0);
+
+  if(!failed) {
+    sqlw.query("begin");
+    // everything we looked at is done with, unless it is waiting again
+    if(full)
+      sqlw.query("delete from indexpending");
+    else {
+      for(auto& w : wantAll)
+        sqlw.queryT("delete from indexpending where uuid=?", {get<string>(w["id"])});
+    }
+    for(const auto& id : waiting)
+      sqlw.addOrReplaceValue({{"uuid", id}}, "indexpending");
+    for(const auto& h : newhwms)
+      sqlw.addOrReplaceValue({{"category", h.first}, {"latest", h.second}}, "indexhwm");
+    sqlw.query("commit");
+    fmt::print("{} documents are waiting for their enclosure, high water marks now {} for Document and {} for Verslag\n",
+               waiting.size(), newhwms["Document"], newhwms["Verslag"]);
+  }
+
+  if(!failed && args.get<bool>("--optimize")) {
+    dt.start();
+    sqlw.query("insert into docsearch(docsearch) values('optimize')");
+    fmt::print("Optimized FTS index in {:.1f} seconds\n", dt.lapUsec() / 1000000.0);
+  }
+  else if(!failed && args.get<int>("--merge") > 0) {
+    dt.start();
+    sqlw.queryT("insert into docsearch(docsearch, rank) values('merge', ?)", {args.get<int>("--merge")});
+    fmt::print("Did {} pages of FTS merge work in {:.1f} seconds\n", args.get<int>("--merge"), dt.lapUsec() / 1000000.0);
+  }
 
   fmt::print("Indexed {} new documents, of which {} were reindexes. {} weren't present, {} of unsupported type, {} were indexed already\n",
 	     (int)indexed, reindex.size(), (int)notpresent, (int)wrong, (int)skipped);
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
 }
@@ -8,33 +8,70 @@
 
 #include "httplib.h"
 #include <set>
+#include <thread>
 #include "support.hh"
+#include <argparse/argparse.hpp>
+#include "git_version.h"
 
 using namespace std;
-void storeDocument(const std::string& id, const std::string& content, const string& prefix)
+struct RetStore
 {
-  string fname=makePathForId(id, prefix, "", true);
-  FILE* t = fopen((fname+".tmp").c_str(), "w");
-  if(!t)
-    throw runtime_error("Unable to open file "+fname+": "+string(strerror(errno)));
-  
-  shared_ptr<FILE> fp(t, fclose);
-  if(fwrite(content.c_str(), 1, content.size(), fp.get()) != content.size()) {
-    unlink(fname.c_str());
-    throw runtime_error("Partial write to file "+fname);
-  }
-  fp.reset();
-  
-  if(rename((fname+".tmp").c_str(), fname.c_str()) < 0) {
-    int e = errno;
-    unlink((fname+".tmp").c_str());
-    throw runtime_error("Unable to rename saved file "+fname+".tmp - "+strerror(e));
+  string id;
+  string enclosure;
+  int64_t contentLength;
+  bool operator<(const RetStore& rhs) const
+  {
+    return id < rhs.id;
   }
+};
+
+static const string g_tkserver = "https://gegevensmagazijn.tweedekamer.nl";
+
+// retrieves and stores one enclosure, see retrieveFile() for the retries
+static bool retrieve(httplib::Client& cli, const RetStore& need, const string& prefix, TokenBucket& tb, std::atomic<uint64_t>& bytes)
+{
+  string path = need.enclosure;
+  if(!path.find(g_tkserver)) // so we can also talk to another server with the same paths
+    path = path.substr(g_tkserver.size());
+  return retrieveFile(cli, path, makePathForId(need.id, prefix, "", true), need.contentLength, tb, bytes);
 }
 
 int main(int argc, char** argv)
 {
+  argparse::ArgumentParser args("tkpull", GIT_VERSION);
+  args.add_argument("-j", "--parallel").help("number of simultaneous downloads").default_value(4).scan<'i', int>();
+  args.add_argument("--rate").help("maximum number of requests per second, all threads together").default_value(10.0).scan<'g', double>();
+  args.add_argument("--server").help("server to retrieve the enclosures from").default_value(g_tkserver);
+  args.add_argument("--reconcile").help("check the enclosure manifest against what is on disk, in the background while we download").flag();
+  try {
+    args.parse_args(argc, argv);
+  }
+  catch (const std::exception& err) {
+    cerr << err.what() << endl;
+    cerr << args;
+    return EXIT_FAILURE;
+  }
+  int parallel = max(1, args.get<int>("--parallel"));
+  TokenBucket tb(args.get<double>("--rate"), parallel);
+  string server = args.get<string>("--server");
+  
   SQLiteWriter sqlw("tk.sqlite3");
+  EnclosureManifest manifest;
+  manifest.bootstrap("docs");
+  manifest.bootstrap("photos");
+  thread reconciler;
+  if(args.get<bool>("--reconcile")) {
+    reconciler = thread([&manifest]() {
+      for(string prefix : {"docs", "photos"}) {
+        try {
+          fmt::print("Reconciled manifest for {}, {} changes\n", prefix, manifest.reconcile(prefix));
+        }
+        catch(std::exception& e) {
+          fmt::print("Error reconciling manifest for {}: {}\n", prefix, e.what());
+        }
+      }
+    });
+  }
 
   int sizlim = 50000000;
   string limit="2007-01-01";
@@ -62,8 +99,10 @@ int main(int argc, char** argv)
     string verslagid=get<string>(td["id"]);
     string fname=makePathForId(verslagid);
     int rc = unlink(fname.c_str());
-    if(!rc)
+    if(!rc) {
+      manifest.forget(verslagid);
       unlinked++;
+    }
     else {
       if(errno != ENOENT)
 	fmt::print("Error removing file {}: {}\n", fname, strerror(errno));
@@ -71,18 +110,7 @@ int main(int argc, char** argv)
   }
   fmt::print("{} niet-nieuwste versies van verslagen gewist\n", unlinked);
 
-  struct RetStore
-  {
-    string id;
-    string enclosure;
-    int64_t contentLength;
-    bool operator<(const RetStore& rhs) const
-    {
-      return id < rhs.id;
-    }
-  };
 
-  
   for(auto store : {&wantDocs, &wantVerslagen, &wantPhotos}) {
     int present=0;
     int toolarge=0, retrieved=0;
@@ -90,19 +118,22 @@ int main(int argc, char** argv)
     cout<<"Starting from a store, got "<<store->size()<<" docs to go"<<endl;
     set<RetStore> toRetrieve;
     string prefix = (store == &wantPhotos) ? "photos" : "docs";
+    auto ondisk = manifest.getAll(prefix);
     for(auto& d : *store) {
-      if(isPresentRightSize(get<string>(d["id"]), get<int64_t>(d["contentLength"]), prefix)  )
+      auto contentLength = get_if<int64_t>(&d["contentLength"]);
+      auto iter = ondisk.find(get<string>(d["id"]));
+      if(iter != ondisk.end() && contentLength && iter->second.size == *contentLength)
 	present++;
       else {
-	auto contentLength = get_if<int64_t>(&d["contentLength"]);
 	toRetrieve.insert({get<string>(d["id"]), get<string>(d["enclosure"]),
 	    contentLength ? *contentLength : 0});
-	if(isPresentNonEmpty(get<string>(d["id"]), prefix))
+	if(iter != ondisk.end() && iter->second.size > 0)
 	  fmt::print("Re-retrieving {}, has wrong size on disk\n", get<string>(d["id"]));
       }
     }
     fmt::print("We have {} files to retrieve, {} are already present\n", toRetrieve.size(), present);
 
+    vector<RetStore> work;
     for(const auto& need : toRetrieve) {
       if(!need.contentLength || need.contentLength > sizlim) {
 	toolarge++;
@@ -110,34 +141,54 @@ int main(int argc, char** argv)
 		   need.id, need.contentLength);
 	continue;
       }
-      
-      httplib::Client cli("https://gegevensmagazijn.tweedekamer.nl");
-      cli.set_connection_timeout(10, 0); 
-      cli.set_read_timeout(10, 0); 
-      cli.set_write_timeout(10, 0); 
-      
-      fmt::print("Retrieving from {} (expect {} bytes).. ", need.enclosure, need.contentLength);
-      cout.flush();
-      auto res = cli.Get(need.enclosure);
-      
-      if(!res) {
-	auto err = res.error();
-	fmt::print("Oops retrieving from {} -> {}\n", need.enclosure, httplib::to_string(err));
-	error++;
-	continue;
-      }
-      if(res->status != 200) {
-	fmt::print("Wrong status code {} for url {}, not storing\n",
-		   res->status, need.enclosure);
-	error++;
-	continue;
-      }
+      work.push_back(need);
+    }
 
-      fmt::print("Got {} bytes\n", res->body.size());
-      storeDocument(need.id, res->body, prefix);
-      retrieved++;
-      usleep(100000);
+    std::atomic<size_t> ctr = 0;
+    std::atomic<int> aretrieved = 0, aerror = 0, running = parallel;
+    std::atomic<uint64_t> bytes = 0;
+    vector<thread> workers;
+    for(int n = 0; n < parallel; ++n) {
+      workers.emplace_back([&]() {
+	httplib::Client cli(server);
+	cli.set_connection_timeout(10, 0); 
+	cli.set_read_timeout(10, 0); 
+	cli.set_write_timeout(10, 0);
+	cli.set_keep_alive(true);
+	for(size_t i = ctr++; i < work.size(); i = ctr++) {
+	  try {
+	    if(retrieve(cli, work[i], prefix, tb, bytes)) {
+	      manifest.record(work[i].id, prefix);
+	      aretrieved++;
+	    }
+	    else
+	      aerror++;
+	  }
+	  catch(std::exception& e) {
+	    fmt::print("Error storing {}: {}\n", work[i].id, e.what());
+	    aerror++;
+	  }
+	}
+	running--;
+      });
+    }
+    DTime dt;
+    dt.start();
+    for(int ticks = 1; running; ++ticks) {
+      this_thread::sleep_for(chrono::seconds(1));
+      if(!(ticks % 10))
+	fmt::print("Progress: {}/{} done, {} errors, {} bytes, {:.1f} kB/s\n", aretrieved + aerror, work.size(),
+		   aerror.load(), bytes.load(), bytes / 1000.0 / ticks);
     }
+    for(auto& w : workers)
+      w.join();
+    uint64_t usec = dt.lapUsec();
+    retrieved = aretrieved;
+    error = aerror;
+    fmt::print("Downloaded {} bytes in {:.1f} seconds, {:.1f} kB/s\n", bytes.load(), usec / 1000000.0,
+	       usec ? bytes * 1000.0 / usec : 0.0);
     fmt::print("Retrieved {} documents, {} were too large, {} errors\n", retrieved, toolarge, error);
   }
+  if(reconciler.joinable())
+    reconciler.join();
 }
@@ -6,12 +6,17 @@
 #include <fmt/ranges.h>
 #include <iostream>
 #include <map>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <zlib.h>
 #include "httplib.h"
 #include "sqlwriter.hh"
 #include "jsonhelper.hh"
 #include "support.hh"
 #include "pugixml.hpp"
-#include "inja.hpp"
+#include "templates.hh"
+#include "textextract.hh"
 
 using namespace std;
 static void replaceSubstring(std::string &originalString, const std::string &searchString, const std::string &replaceString) {
@@ -65,30 +70,62 @@ void bulkEscape(nlohmann::json& j)
   });
 }
 
-static string getReasonableJPEG(const std::string& id)
+static string getContentsOfFile(const std::string& fname)
+{
+  FILE* pfp = fopen(fname.c_str(), "r");
+  if(!pfp)
+    throw runtime_error("Unable to get document "+fname+": "+string(strerror(errno)));
+  
+  shared_ptr<FILE> fp(pfp, fclose);
+  struct stat sb;
+  if(fstat(fileno(fp.get()), &sb) < 0)
+    return "";
+  // in one go, the file won't be growing, everything in the caches gets renamed into place
+  string ret;
+  ret.resize(sb.st_size);
+  if(fread(ret.data(), 1, ret.size(), fp.get()) != ret.size())
+    return "";
+  return ret;
+}
+
+/* The rendered versions of documents & photos we serve most are kept in memory, keyed on the mtime the
+   manifest has for the source, so a hit needs no stat() or open(). If the manifest doesn't know the
+   source this returns "", and BlobCache doesn't store anything under that */
+static string memKey(EnclosureManifest& manifest, const std::string& id, const std::string& prefix, const std::string& suffix)
 {
+  if(auto e = manifest.get(id, prefix))
+    return fmt::format("{}/{}{}@{}", prefix, id, suffix, e->mtime);
+  return "";
+}
+
+// hands httplib the shared buffer, instead of a copy of it
+static void setSharedContent(httplib::Response& res, shared_ptr<const string> content, const std::string& type)
+{
+  res.set_content_provider(content->size(), type, [content](size_t offset, size_t length, httplib::DataSink& sink) {
+    return sink.write(content->data() + offset, min(length, content->size() - offset));
+  });
+}
+
+static string convertToJPEG(const std::string& id);
+
+static shared_ptr<const string> getReasonableJPEG(BlobCache& mem, ConversionService& conv, EnclosureManifest& manifest, const std::string& id)
+{
+  string key = memKey(manifest, id, "photos", ".jpg");
+  if(auto hit = mem.get(key))
+    return hit;
   if(isPresentNonEmpty(id, "photoscache", ".jpg") && cacheIsNewer(id, "photoscache", ".jpg", "photos")) {
-    string fname = makePathForId(id, "photoscache", ".jpg");
-    FILE* pfp = fopen(fname.c_str(), "r");
-    if(!pfp)
-      throw runtime_error("Unable to get cached photo "+id+": "+string(strerror(errno)));
-    
-    shared_ptr<FILE> fp(pfp, fclose);
-    char buffer[4096];
-    string ret;
-    for(;;) {
-      int len = fread(buffer, 1, sizeof(buffer), fp.get());
-      if(!len)
-	break;
-      ret.append(buffer, len);
-    }
-    if(!ferror(fp.get())) {
+    string ret = getContentsOfFile(makePathForId(id, "photoscache", ".jpg"));
+    if(!ret.empty()) {
       fmt::print("Had a cache hit for {} photo\n", id);
-      return ret;
+      return mem.put(key, std::move(ret));
     }
     // otherwise fall back to normal process
   }
-  // 
+  return mem.put(key, conv.get("jpeg:"+id, [id]() { return convertToJPEG(id); }));
+}
+
+static string convertToJPEG(const std::string& id)
+{
   string fname = makePathForId(id, "photos");
   string command = fmt::format("convert -resize 400 -format jpeg - - < '{}'",
 			  fname);
@@ -122,60 +159,56 @@ static string getReasonableJPEG(const std::string& id)
   return ret;
 }
 
-static string getContentsOfFile(const std::string& fname)
-{
-  FILE* pfp = fopen(fname.c_str(), "r");
-  if(!pfp)
-    throw runtime_error("Unable to get document "+fname+": "+string(strerror(errno)));
-  
-  shared_ptr<FILE> fp(pfp, fclose);
-  char buffer[4096];
-  string ret;
-  for(;;) {
-    int len = fread(buffer, 1, sizeof(buffer), fp.get());
-    if(!len)
-      break;
-    ret.append(buffer, len);
-  }
-  if(!ferror(fp.get())) {
-    return ret;
-  }
-  return "";
-}
+static string convertToHtml(EnclosureManifest& manifest, const std::string& id, bool bare);
 
 // for verslag XML, this makes html w/o <html> etc, for use in a .div
-static string getHtmlForDocument(const std::string& id, bool bare=false)
+static shared_ptr<const string> getHtmlForDocument(BlobCache& mem, ConversionService& conv, EnclosureManifest& manifest, const std::string& id, bool bare=false)
 {
   string suffix = bare ? ".div" : ".html";
+  string key = memKey(manifest, id, "docs", suffix);
+  if(auto hit = mem.get(key))
+    return hit;
   if(isPresentNonEmpty(id, "doccache", suffix) && cacheIsNewer(id, "doccache", suffix, "docs")) {
     string fname = makePathForId(id, "doccache", suffix);
     string ret = getContentsOfFile(fname);
     fmt::print("Cache hit in {} for {}, bare={}\n", __FUNCTION__, id, bare);
     if(!ret.empty())
-      return ret;
+      return mem.put(key, std::move(ret));
     // otherwise fall back to normal process
   }
-  
+  return mem.put(key, conv.get("html:"+id+suffix, [&manifest, id, bare]() { return convertToHtml(manifest, id, bare); }));
+}
+
+static string convertToHtml(EnclosureManifest& manifest, const std::string& id, bool bare)
+{
+  string suffix = bare ? ".div" : ".html";
   string fname = makePathForId(id);
   string command;
 
-  if(isDocx(fname))
+  FileType type = manifest.getFileType(id);
+  switch(type) {
+  case FileType::Docx:
     command = fmt::format("pandoc {} -f docx   --embed-resources  --variable maxwidth=72em -t html '{}'",
 			  bare ? "" : "-s", fname);
-  else if(isRtf(fname))
+    break;
+  case FileType::Rtf:
     command = fmt::format("pandoc {} -f rtf   --embed-resources  --variable maxwidth=72em -t html '{}'",
 			  bare ? "" : "-s",
 			  fname);
-  else if(isDoc(fname))
+    break;
+  case FileType::Doc:
     command = fmt::format("echo '<pre>' ; catdoc < '{}'; echo '</pre>'",
 			  fname);
-  else if(isXML(fname))
+    break;
+  case FileType::XML:
     command = fmt::format("xmlstarlet tr tk-div.xslt < '{}'",
 			  fname);
-  else
+    break;
+  default:
     command = fmt::format("pdftohtml {} {} -dataurls -stdout", bare ? "": "-s", fname);
+  }
 
-  fmt::print("Command: {} {} \n", command, isXML(fname));
+  fmt::print("Command: {} {} \n", command, fileTypeName(type));
   FILE* pfp = popen(command.c_str(), "r");
   if(!pfp)
     throw runtime_error("Unable to perform conversion for '"+command+"': "+string(strerror(errno)));
@@ -211,18 +244,27 @@ static string getHtmlForDocument(const std::string& id, bool bare=false)
   return ret;
 }
 
-static string getPDFForDocx(const std::string& id)
+static string convertDocxToPDF(const std::string& id);
+
+static shared_ptr<const string> getPDFForDocx(BlobCache& mem, ConversionService& conv, EnclosureManifest& manifest, const std::string& id)
 {
+  string key = memKey(manifest, id, "docs", ".pdf");
+  if(auto hit = mem.get(key))
+    return hit;
   if(isPresentNonEmpty(id, "doccache", ".pdf") && cacheIsNewer(id, "doccache", ".pdf", "docs")) {
     string fname = makePathForId(id, "doccache", ".pdf");
     string ret = getContentsOfFile(fname);
     if(!ret.empty()) {
       fmt::print("Had a cache hit for {} PDF\n", id);
-      return ret;
+      return mem.put(key, std::move(ret));
     }
     // otherwise fall back to normal process
   }
-  // 
+  return mem.put(key, conv.get("pdf:"+id, [id]() { return convertDocxToPDF(id); }));
+}
+
+static string convertDocxToPDF(const std::string& id)
+{
   string fname = makePathForId(id);
   string command = fmt::format("pandoc -s --metadata \"margin-left:1cm\" --metadata \"margin-right:1cm\" -V fontfamily=\"dejavu\"  --variable mainfont=\"DejaVu Serif\" --variable sansfont=Arial --pdf-engine=xelatex -f docx -t pdf '{}'",
 			  fname);
@@ -256,13 +298,190 @@ static string getPDFForDocx(const std::string& id)
   return ret;
 }
 
-static string getRawDocument(const std::string& id)
+static string httpDate(time_t t)
 {
-  string fname = makePathForId(id);
-  string ret = getContentsOfFile(fname);
-  if(ret.empty())
-     throw runtime_error("Unable to perform pdftotext: "+string(strerror(errno)));
-  return ret;
+  struct tm tm;
+  gmtime_r(&t, &tm);
+  char buf[64];
+  strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+  return buf;
+}
+
+// sets ETag and Last-Modified, and returns true with a 304 in res if the client has this version already
+static bool notModified(const httplib::Request& req, httplib::Response& res, const std::string& etag, time_t mtime)
+{
+  res.set_header("ETag", etag);
+  res.set_header("Last-Modified", httpDate(mtime));
+  bool fresh = false;
+  if(req.has_header("If-None-Match")) {
+    string inm = req.get_header_value("If-None-Match");
+    fresh = inm == "*" || inm.find(etag) != string::npos;
+  }
+  else if(req.has_header("If-Modified-Since")) {
+    struct tm tm = {};
+    fresh = strptime(req.get_header_value("If-Modified-Since").c_str(), "%a, %d %b %Y %H:%M:%S GMT", &tm) && mtime <= timegm(&tm);
+  }
+  if(fresh)
+    res.status = 304;
+  return fresh;
+}
+
+/* Goes up whenever tkconv wrote something (or we restarted), so anything we send that is based on
+   the database stays valid as long as this does. Based on the mtimes of the databases and their WAL files,
+   looked at by a background thread, so requests can check it without any SQL or even a stat() */
+class DataVersion
+{
+public:
+  explicit DataVersion(const std::vector<std::string>& fnames) :
+    d_fnames(fnames), d_start(chrono::duration_cast<chrono::nanoseconds>(chrono::system_clock::now().time_since_epoch()).count())
+  {
+    update();
+    d_thread = thread([this]() {
+      while(!d_stop) {
+        this_thread::sleep_for(chrono::seconds(2));
+        update();
+      }
+    });
+  }
+  ~DataVersion()
+  {
+    d_stop = true;
+    d_thread.join();
+  }
+  uint64_t get() const
+  {
+    return d_version;
+  }
+private:
+  void update()
+  {
+    uint64_t v = d_start;
+    struct stat sb;
+    for(const auto& f : d_fnames) {
+      for(const auto& fname : {f, f + "-wal"})
+        if(!stat(fname.c_str(), &sb))
+          v = max(v, (uint64_t)(sb.st_mtim.tv_sec * 1000000000ULL + sb.st_mtim.tv_nsec));
+    }
+    d_version = v;
+  }
+  std::vector<std::string> d_fnames;
+  uint64_t d_start;
+  std::atomic<uint64_t> d_version;
+  std::atomic<bool> d_stop{false};
+  std::thread d_thread;
+};
+
+static string gzipCompress(const std::string& in)
+{
+  z_stream zs = {};
+  if(deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) // +16 = gzip header
+    throw runtime_error("Could not initialize zlib");
+  string out(deflateBound(&zs, in.size()), '\0');
+  zs.next_in = (Bytef*)in.c_str();
+  zs.avail_in = in.size();
+  zs.next_out = (Bytef*)out.data();
+  zs.avail_out = out.size();
+  int ret = deflate(&zs, Z_FINISH);
+  out.resize(zs.total_out);
+  deflateEnd(&zs);
+  if(ret != Z_STREAM_END)
+    throw runtime_error("Could not gzip response");
+  return out;
+}
+
+/* Finished bodies for the heavy list endpoints, plain and gzipped. Keyed on data version, so an ingest makes
+   everything stale and the LRU gets rid of it. Thread safe */
+class ResponseCache
+{
+public:
+  explicit ResponseCache(size_t maxbytes) : d_blobs(maxbytes, 1) // few & big entries, one shard is plenty
+  {}
+  // fills res and returns true if we have key for this version
+  bool serve(const httplib::Request& req, httplib::Response& res, const std::string& key, uint64_t version)
+  {
+    string type;
+    {
+      lock_guard<mutex> l(d_lock);
+      auto iter = d_types.find(key);
+      if(iter == d_types.end())
+        return false;
+      type = iter->second;
+    }
+    bool gzip = req.get_header_value("Accept-Encoding").find("gzip") != string::npos;
+    auto blob = d_blobs.get(blobKey(key, version, gzip));
+    if(!blob)
+      return false;
+    res.set_header("Vary", "Accept-Encoding");
+    if(gzip)
+      res.set_header("Content-Encoding", "gzip");
+    setSharedContent(res, blob, type);
+    return true;
+  }
+  void put(const std::string& key, uint64_t version, std::string&& body, const std::string& type)
+  {
+    // compressing once here is what makes the gzipped version cheap to serve
+    d_blobs.put(blobKey(key, version, true), gzipCompress(body));
+    d_blobs.put(blobKey(key, version, false), std::move(body));
+    lock_guard<mutex> l(d_lock);
+    d_types[key] = type;
+  }
+private:
+  static string blobKey(const std::string& key, uint64_t version, bool gzip)
+  {
+    return fmt::format("{:x} {} {}", version, gzip ? "gz" : "id", key);
+  }
+  BlobCache d_blobs;
+  std::unordered_map<std::string, std::string> d_types; // as many as there are routes & variants
+  std::mutex d_lock;
+};
+
+// read-only mapping of a file, unmapped once the last response using it is done
+struct MappedFile
+{
+  MappedFile(const MappedFile&) = delete;
+  MappedFile(void* data, size_t size) : d_data((const char*)data), d_size(size) {}
+  ~MappedFile()
+  {
+    munmap((void*)d_data, d_size);
+  }
+  const char* d_data;
+  size_t d_size;
+};
+
+/* Serves fname straight from an mmap, no copies. httplib does Range requests for us, so PDF viewers can
+   fetch what they need. Everything in docs/ gets renamed into place, so our mapping stays valid if tkpull
+   replaces the file */
+static void serveFile(const httplib::Request& req, httplib::Response& res, const std::string& fname, const std::string& type)
+{
+  int fd = open(fname.c_str(), O_RDONLY);
+  if(fd < 0)
+    throw runtime_error("Unable to open "+fname+": "+string(strerror(errno)));
+  struct stat sb;
+  if(fstat(fd, &sb) < 0) {
+    int e = errno;
+    close(fd);
+    throw runtime_error("Unable to stat "+fname+": "+string(strerror(e)));
+  }
+  res.set_header("Accept-Ranges", "bytes");
+  if(notModified(req, res, fmt::format("\"{:x}-{:x}\"", sb.st_size, sb.st_mtim.tv_sec * 1000000000ULL + sb.st_mtim.tv_nsec), sb.st_mtime)) {
+    close(fd);
+    return;
+  }
+  if(!sb.st_size) {
+    close(fd);
+    res.set_content("", type);
+    return;
+  }
+  void* data = mmap(nullptr, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  int e = errno;
+  close(fd);
+  if(data == MAP_FAILED)
+    throw runtime_error("Unable to map "+fname+": "+string(strerror(e)));
+
+  auto mf = make_shared<MappedFile>(data, sb.st_size);
+  res.set_content_provider(mf->d_size, type, [mf](size_t offset, size_t length, httplib::DataSink& sink) {
+    return sink.write(mf->d_data + offset, min(length, mf->d_size - offset));
+  });
 }
 
 struct VoteResult
@@ -345,20 +564,30 @@ time_t getTstamp(const std::string& str)
   return timelocal(&tm);
 }
 
+static string convertExternalToHtml(const std::string& id);
+
 // this processes .odt from officielepublicaties and turns it into HTML
-std::string getBareHtmlFromExternal(const std::string& id)
+shared_ptr<const string> getBareHtmlFromExternal(BlobCache& mem, ConversionService& conv, const std::string& id)
 {
   if(id.find_first_of("./") != string::npos)
     throw runtime_error("external id contained illegal characters");
 
+  // officiele publicaties don't change once they are out, so no mtime in this key
+  string key = "op/"+id+".html";
+  if(auto hit = mem.get(key))
+    return hit;
   if(haveExternalIdFile(id, "opcache", ".html")) {
     string ret = getContentsOfFile(makePathForExternalID(id, "opcache", ".html"));
     if(!ret.empty()) {
       fmt::print("Got cache hit for external content {}!\n", id);
-      return ret;
+      return mem.put(key, std::move(ret));
     }
   }
+  return mem.put(key, conv.get("op:"+id, [id]() { return convertExternalToHtml(id); }));
+}
 
+static string convertExternalToHtml(const std::string& id)
+{
   string command = fmt::format("pandoc -f odt op/{}/{}.odt -t html --embed-resources -t html",
 			       getSubdirForExternalID(id),
 			       id);
@@ -398,13 +627,108 @@ std::string getBareHtmlFromExternal(const std::string& id)
 
 int main(int argc, char** argv)
 {
-  SQLiteWriter unlockedsqlw("tk.sqlite3");
-  std::mutex sqwlock;
-  LockedSqw sqlw{unlockedsqlw, sqwlock};
+  setWALMode("tk.sqlite3");
+  // one read-only connection for every worker thread httplib starts
+  LockedSqw sqlw("tk.sqlite3", CPPHTTPLIB_THREAD_POOL_COUNT);
+  // search connections keep tk.sqlite3 attached and have their own scratch table
+  LockedSqw idxsqw("tkindex.sqlite3", CPPHTTPLIB_THREAD_POOL_COUNT,
+                   {"ATTACH DATABASE 'tk.sqlite3' as meta",
+                    "create temp table uuids (uuid TEXT, snip TEXT, score REAL, category TEXT)"});
+  // file types of the enclosures, so we don't sniff them on every request
+  EnclosureManifest manifest("enclosures.sqlite3", true); // tkpull writes it, we only read
+  // pandoc & friends run here, and not once for every request that wants the same document
+  ConversionService conv(max(2U, thread::hardware_concurrency()/2), 64);
+  // rendered documents & photos, TKSERV_MEMCACHE_MB to change its size
+  BlobCache mem((getenv("TKSERV_MEMCACHE_MB") ? atoi(getenv("TKSERV_MEMCACHE_MB")) : 512) * 1000000ULL);
+  // a contentless index (tkindex --contentless) keeps uuid, datum & category in 'indexed', and has no text for snippets
+  bool contentless = false;
+  if(auto ret = idxsqw.query("select sql from sqlite_master where name='docsearch'"); !ret.empty())
+    contentless = get<string>(ret[0]["sql"]).find("content=''") != string::npos;
+  unique_ptr<TextCache> textcache;
+  if(contentless) {
+    fmt::print("Search index is contentless, snippets come from the text cache\n");
+    textcache = make_unique<TextCache>("textcache.sqlite3", CPPHTTPLIB_THREAD_POOL_COUNT, true);
+  }
+  string ftsfrom = contentless ? "docsearch, indexed" : "docsearch";
+  string ftsjoin = contentless ? "indexed.id = docsearch.rowid and " : "";
+  string ftssnip = contentless ? "''" : "snippet(docsearch,-1, '<b>', '</b>', '...', 20)";
+  TemplateRegistry tmpls("./partials/");
+  if(getenv("TKSERV_RELOAD_TEMPLATES"))
+    tmpls.watch();
   signal(SIGPIPE, SIG_IGN); // every TCP application needs this
   httplib::Server svr;
 
-  svr.Get("/getdoc/:nummer", [&sqlw](const httplib::Request &req, httplib::Response &res) {
+  // ETags & cached responses for everything that comes out of the database, see dbGet and cachedGet below.
+  // Not if templates can change under us. Only tk.sqlite3: we write enclosures.sqlite3 ourselves
+  DataVersion dataversion({"tk.sqlite3"});
+  bool etags = !getenv("TKSERV_RELOAD_TEMPLATES");
+  // same data, same day (for things like jarig-vandaag), same request: same answer
+  auto requestKey = [](const httplib::Request& req) {
+    string what = fmt::format("{:%Y-%m-%d}", fmt::localtime(time(0))) + req.path;
+    for(const auto& p : req.params)
+      what += "&" + p.first + "=" + p.second;
+    return what;
+  };
+  auto dataETag = [&dataversion, &requestKey](const httplib::Request& req) {
+    return fmt::format("\"{:x}-{:x}\"", dataversion.get(), std::hash<string>{}(requestKey(req)));
+  };
+  /* For routes whose answer only depends on the database. The ETag is decided before running any SQL, so
+     if the data changes while we're busy the next request gets it all. Static files from the mount point
+     and /getdoc/ & /getraw/ do their own */
+  auto dbGet = [&svr, etags, &dataETag](const string& pattern, httplib::Server::Handler h) {
+    if(!etags) {
+      svr.Get(pattern, h);
+      return;
+    }
+    svr.Get(pattern, [&dataETag, h](const httplib::Request& req, httplib::Response& res) {
+      string etag = dataETag(req);
+      if(req.has_header("If-None-Match") && req.get_header_value("If-None-Match").find(etag) != string::npos) {
+        res.status = 304;
+        res.set_header("ETag", etag);
+        return;
+      }
+      h(req, res);
+      // errors and redirects don't get to be cached
+      if(res.status == -1 || res.status == 200) {
+        res.set_header("ETag", etag);
+        res.set_header("Cache-Control", "no-cache");
+      }
+    });
+  };
+
+  /* For the heavy list endpoints that only depend on the data, the day and variant(req), which picks out the
+     parameters the handler looks at. The first request for a data version runs the handler, the rest get
+     the stored body. Only path itself gets cached, whatever a crawler appends to it runs the handler as
+     usual. path is also what the warmer below asks for after an ingest */
+  ResponseCache respcache(128000000);
+  map<string, httplib::Server::Handler> warmers;
+  auto cachedGet = [&](const string& pattern, const string& path, httplib::Server::Handler h,
+                       std::function<string(const httplib::Request&)> variant = nullptr) {
+    if(!etags) {
+      svr.Get(pattern, h);
+      return;
+    }
+    httplib::Server::Handler cached = [&respcache, &dataversion, pattern, path, h, variant](const httplib::Request& req, httplib::Response& res) {
+      if(req.path != path && req.path != path + "/") {
+        h(req, res);
+        return;
+      }
+      // before running the handler, like the ETag
+      uint64_t version = dataversion.get();
+      string key = fmt::format("{:%Y-%m-%d} {}", fmt::localtime(time(0)), pattern);
+      if(variant)
+        key += " " + variant(req);
+      if(respcache.serve(req, res, key, version))
+        return;
+      h(req, res);
+      if((res.status == -1 || res.status == 200) && !res.body.empty())
+        respcache.put(key, version, string(res.body), res.get_header_value("Content-Type"));
+    };
+    dbGet(pattern, cached);
+    warmers[path] = cached;
+  };
+
+  svr.Get("/getdoc/:nummer", [&sqlw, &manifest, &conv, &mem](const httplib::Request &req, httplib::Response &res) {
     string nummer=req.path_params.at("nummer"); // 2023D41173
     cout<<"getdoc nummer: "<<nummer<<endl;
 
@@ -440,12 +764,13 @@ int main(int argc, char** argv)
     // docx to pdf is better for embedded images it appears
     // XXX disabled
     if(0 && contentType == "application/vnd.openxmlformats-officedocument.wordprocessingml.document") {
-      string content = getPDFForDocx(id);
-      res.set_content(content, "application/pdf");
+      setSharedContent(res, getPDFForDocx(mem, conv, manifest, id), "application/pdf");
     }
     else {
-      string content = getHtmlForDocument(id);
-      res.set_content(content, "text/html; charset=utf-8");
+      // the HTML only changes if the enclosure does
+      if(auto e = manifest.get(id); e && notModified(req, res, fmt::format("\"{}-html\"", e->hash), e->mtime / 1000000000))
+        return;
+      setSharedContent(res, getHtmlForDocument(mem, conv, manifest, id), "text/html; charset=utf-8");
     }
   });
 
@@ -469,11 +794,11 @@ int main(int argc, char** argv)
     else
       id = get<string>(ret[0]["id"]);
 
-    string content = getRawDocument(id);
-    res.set_content(content, get<string>(ret[0]["contentType"]));
+    serveFile(req, res, makePathForId(id), get<string>(ret[0]["contentType"]));
   });
 
-  svr.Get("/personphoto/:nummer", [&sqlw](const httplib::Request &req, httplib::Response &res) {
+  // not dbGet, tkpull fetches the photo after tkconv is done and the data version doesn't see that
+  svr.Get("/personphoto/:nummer", [&sqlw, &conv, &mem, &manifest](const httplib::Request &req, httplib::Response &res) {
     string nummer=req.path_params.at("nummer"); // 1234
     cout<<"persoon nummer: "<<nummer<<endl;
     auto ret=sqlw.query("select * from Persoon where nummer=? order by rowid desc limit 1", {nummer});
@@ -484,11 +809,13 @@ int main(int argc, char** argv)
       return;
     }
     string id = get<string>(ret[0]["id"]);
-    string content = getReasonableJPEG(id);
-    res.set_content(content, "image/jpeg");
+    // the JPEG only changes if the photo does
+    if(auto e = manifest.get(id, "photos"); e && notModified(req, res, fmt::format("\"{}-jpg\"", e->hash), e->mtime / 1000000000))
+      return;
+    setSharedContent(res, getReasonableJPEG(mem, conv, manifest, id), "image/jpeg");
   });
 
-  svr.Get("/sitemap-(20\\d\\d).txt", [&sqlw](const auto& req, auto& res) {
+  dbGet("/sitemap-(20\\d\\d).txt", [&sqlw](const auto& req, auto& res) {
     string year = req.matches[1];
     year += "-%";
     auto nums=sqlw.query("select nummer from Document where datum like ?", {year});
@@ -505,7 +832,7 @@ int main(int argc, char** argv)
   });
 
   // officiele publicatie redirect
-  svr.Get("/op/:extid", [&sqlw](const httplib::Request &req, httplib::Response &res) {
+  dbGet("/op/:extid", [&sqlw](const httplib::Request &req, httplib::Response &res) {
     string extid=req.path_params.at("extid"); 
     auto docs = sqlw.query("select nummer from documentversie,document where externeidentifier=? and documentversie.documentid=document.id", {extid});
     if(docs.empty()) {
@@ -518,7 +845,7 @@ int main(int argc, char** argv)
     res.set_header("Location", "../document.html?nummer="+dest);
   });
   
-  svr.Get("/sitemap-(20\\d\\d-\\d\\d).txt", [&sqlw](const auto& req, auto& res) {
+  dbGet("/sitemap-(20\\d\\d-\\d\\d).txt", [&sqlw](const auto& req, auto& res) {
     string year = req.matches[1];
     year += "-%";
     auto nums=sqlw.query("select nummer from Document where datum like ?", {year});
@@ -534,26 +861,26 @@ int main(int argc, char** argv)
   });
 
   
-  svr.Get("/jarig-vandaag", [&sqlw](const httplib::Request &req, httplib::Response &res) {
+  cachedGet("/jarig-vandaag", "/jarig-vandaag", [&sqlw](const httplib::Request &req, httplib::Response &res) {
     string f = fmt::format("{:%%-%m-%d}", fmt::localtime(time(0)));
     auto jarig = sqlw.queryJRet("select geboortedatum,roepnaam,initialen,tussenvoegsel,achternaam,afkorting,persoon.nummer from Persoon,fractiezetelpersoon,fractiezetel,fractie where geboortedatum like ? and persoon.functie ='Tweede Kamerlid' and  persoonid=persoon.id and fractiezetel.id=fractiezetelpersoon.fractiezetelid and fractie.id=fractiezetel.fractieid order by achternaam, roepnaam", {f});
     res.set_content(jarig.dump(), "application/json");
     return;
   });
 
-  svr.Get("/kamerleden/?", [&sqlw](const httplib::Request &req, httplib::Response &res) {
+  cachedGet("/kamerleden/?", "/kamerleden", [&sqlw](const httplib::Request &req, httplib::Response &res) {
     auto leden = sqlw.queryJRet("select fractiezetel.gewicht, persoon.*, afkorting from Persoon,fractiezetelpersoon,fractiezetel,fractie where persoon.functie='Tweede Kamerlid' and  persoonid=persoon.id and fractiezetel.id=fractiezetelpersoon.fractiezetelid and fractie.id=fractiezetel.fractieid and totEnMet='' order by afkorting, fractiezetel.gewicht");
     res.set_content(leden.dump(), "application/json");    
   });
 
-  svr.Get("/commissies/?", [&sqlw](const httplib::Request &req, httplib::Response &res) {
+  cachedGet("/commissies/?", "/commissies", [&sqlw](const httplib::Request &req, httplib::Response &res) {
 
     auto j = sqlw.queryJRet("select commissieid,max(datum) mdatum,commissie.afkorting, commissie.naam, inhoudsopgave,commissie.soort from activiteitactor,commissie,activiteit where commissie.id=activiteitactor.commissieid and activiteitactor.activiteitid = activiteit.id group by 1 order by commissie.naam asc"); 
 
     res.set_content(j.dump(), "application/json");    
   });
 
-  svr.Get("/commissie/:id", [&sqlw](const httplib::Request &req, httplib::Response &res) {
+  dbGet("/commissie/:id", [&sqlw](const httplib::Request &req, httplib::Response &res) {
     string id = req.path_params.at("id");
     nlohmann::json j = nlohmann::json::object();
     j["leden"] = sqlw.queryJRet("select Commissie.naam, commissie.afkorting cafkorting, commissiezetel.gewicht, CommissieZetelVastPersoon.functie cfunctie, persoon.*, fractie.afkorting fafkorting from Commissie,CommissieZetel,CommissieZetelVastPersoon, Persoon,fractiezetelpersoon,fractiezetel,fractie where Persoon.id=commissiezetelvastpersoon.PersoonId and CommissieZetel.commissieId = Commissie.id and CommissieZetelVastpersoon.CommissieZetelId = commissiezetel.id and fractiezetel.id=fractiezetelpersoon.fractiezetelid and fractie.id=fractiezetel.fractieid and fractiezetelpersoon.persoonId = Persoon.id and commissie.id=? and fractie.datumInactief='' and fractiezetelpersoon.totEnMet='' and CommissieZetelVastPersoon.totEnMet='' order by commissiezetel.gewicht", {id}); 
@@ -573,7 +900,7 @@ int main(int argc, char** argv)
   });
 
   
-  svr.Get("/persoon.html", [&sqlw](const httplib::Request &req, httplib::Response &res) {
+  dbGet("/persoon.html", [&sqlw, &tmpls](const httplib::Request &req, httplib::Response &res) {
     int nummer = atoi(req.get_param_value("nummer").c_str());
 
     auto lid = sqlw.queryJRet("select * from Persoon where persoon.nummer=?", {nummer});
@@ -613,15 +940,12 @@ int main(int argc, char** argv)
     j["og"]["description"] = "Persoon";
     j["og"]["imageurl"] = "https://berthub.eu/tkconv/personphoto/"+to_string(nummer);
 
-    inja::Environment e;
-    e.set_html_autoescape(true);
-    
-    res.set_content(e.render_file("./partials/persoon.html", j), "text/html");
+    res.set_content(tmpls.render("persoon.html", j), "text/html");
     return;
   });
 
   
-  svr.Get("/zaak.html", [&sqlw](const httplib::Request &req, httplib::Response &res) {
+  dbGet("/zaak.html", [&sqlw, &tmpls](const httplib::Request &req, httplib::Response &res) {
     string nummer = req.get_param_value("nummer");
     nlohmann::json z = nlohmann::json::object();
     auto zaken = sqlw.query("select *, substr(gestartOp, 0, 11) gestartOp from zaak where nummer=?", {nummer});
@@ -684,14 +1008,11 @@ int main(int argc, char** argv)
     z["og"]["description"] = "Persoon";
     z["og"]["imageurl"] = "";
 
-    inja::Environment e;
-    e.set_html_autoescape(true);
-    
-    res.set_content(e.render_file("./partials/zaak.html", z), "text/html");
+    res.set_content(tmpls.render("zaak.html", z), "text/html");
   });    
 
 
-  svr.Get("/persoonplus/:id", [&sqlw](const httplib::Request &req, httplib::Response &res) {
+  dbGet("/persoonplus/:id", [&sqlw](const httplib::Request &req, httplib::Response &res) {
     string id = req.path_params.at("id"); // 9e79de98-e914-4dc8-8dc7-6d7cb09b93d7
     cout<<"Lookup for "<<id<<endl;
     auto persoon = sqlw.query("select * from Persoon where id=?", {id});
@@ -727,7 +1048,7 @@ int main(int argc, char** argv)
 
   
 
-  svr.Get("/activiteit/:nummer", [&sqlw](const httplib::Request &req, httplib::Response &res) {
+  dbGet("/activiteit/:nummer", [&sqlw](const httplib::Request &req, httplib::Response &res) {
     string nummer=req.path_params.at("nummer"); // 2024A02517
     cout<<"/activiteit/:nummer: "<<nummer<<endl;
 
@@ -841,9 +1162,7 @@ int main(int argc, char** argv)
 
 
   auto doTemplate = [&](const string& name, const string& file, const string& q = string()) {
-    svr.Get("/"+name+"(/?.*)", [&sqlw, name, file, q](const httplib::Request &req, httplib::Response &res) {
-      inja::Environment e;
-      e.set_html_autoescape(true);
+    cachedGet("/"+name+"(/?.*)", "/"+name, [&sqlw, &tmpls, name, file, q](const httplib::Request &req, httplib::Response &res) {
       nlohmann::json data;
       if(!q.empty())
 	data["data"] = sqlw.queryJRet(q);
@@ -853,7 +1172,7 @@ int main(int argc, char** argv)
       data["og"]["description"] = name;
       data["og"]["imageurl"] = "";
 
-      res.set_content(e.render_file("./partials/"+file, data), "text/html");
+      res.set_content(tmpls.render(file, data), "text/html");
     });
   };
 
@@ -880,7 +1199,7 @@ int main(int argc, char** argv)
     res.set_header("Location", "./");
   });
   
-  svr.Get("/", [&sqlw](const httplib::Request &req, httplib::Response &res) {
+  cachedGet("/", "/", [&sqlw, &tmpls](const httplib::Request &req, httplib::Response &res) {
     bool onlyRegeringsstukken = req.has_param("onlyRegeringsstukken") && req.get_param_value("onlyRegeringsstukken") != "0";
     string dlim = fmt::format("{:%Y-%m-%d}", fmt::localtime(time(0) - 8*86400));
     nlohmann::json data;
@@ -913,22 +1232,21 @@ int main(int argc, char** argv)
     string f = fmt::format("{:%%-%m-%d}", fmt::localtime(time(0)));
     data["jarigVandaag"] = sqlw.queryJRet("select geboortedatum,roepnaam,initialen,tussenvoegsel,achternaam,afkorting,persoon.nummer from Persoon,fractiezetelpersoon,fractiezetel,fractie where geboortedatum like ? and persoon.functie ='Tweede Kamerlid' and  persoonid=persoon.id and fractiezetel.id=fractiezetelpersoon.fractiezetelid and fractie.id=fractiezetel.fractieid and fractiezetelpersoon.totEnMet='' order by achternaam, roepnaam", {f});
     
-    inja::Environment e;
-    e.set_html_autoescape(true);
-
     data["pagemeta"]["title"]="";
     data["og"]["title"] = "Recente documenten";
     data["og"]["description"] = "Recente documenten uit de Tweede Kamer";
     data["og"]["imageurl"] = "";
     
-    res.set_content(e.render_file("./partials/index.html", data), "text/html");
+    res.set_content(tmpls.render("index.html", data), "text/html");
+  }, [](const httplib::Request& req) {
+    return string(req.has_param("onlyRegeringsstukken") && req.get_param_value("onlyRegeringsstukken") != "0" ? "1" : "0");
   });
 
-  svr.Get("/recente-kamervragen", [&sqlw](const httplib::Request &req, httplib::Response &res) {
+  cachedGet("/recente-kamervragen", "/recente-kamervragen", [&sqlw](const httplib::Request &req, httplib::Response &res) {
     res.set_content(sqlw.queryJRet("select nummer,onderwerp,naam,gestartOp from Zaak,ZaakActor where zaakid=zaak.id and relatie='Indiener' and gestartOp > '2018-01-01' and soort = 'Schriftelijke vragen' order by gestartOp desc").dump(), "application/json"); // XXX hardcoded date
   });
   
-  svr.Get("/open-vragen.html", [&sqlw](const httplib::Request &req, httplib::Response &res) {
+  cachedGet("/open-vragen.html", "/open-vragen.html", [&sqlw, &tmpls](const httplib::Request &req, httplib::Response &res) {
     nlohmann::json data;
     auto ovragen =  sqlw.queryJRet("select *, max(persoon.nummer) filter (where relatie ='Indiener') as persoonnummer, max(zaakactor.functie) filter (where relatie='Gericht aan') as aan, max(naam) filter (where relatie='Indiener') as indiener from openvragen,zaakactor,persoon where zaakactor.zaakid = openvragen.id and persoon.id = zaakactor.persoonId group by openvragen.id order by gestartOp desc");
 
@@ -945,19 +1263,16 @@ int main(int argc, char** argv)
     }
     data["openVragen"] = ovragen;
     
-    inja::Environment e;
-    e.set_html_autoescape(true);
-
     data["pagemeta"]["title"]="";
     data["og"]["title"] = "Open vragen";
     data["og"]["description"] = "Open vragen uit de Tweede Kamer";
     data["og"]["imageurl"] = "";
     
-    res.set_content(e.render_file("./partials/open-vragen.html", data), "text/html");
+    res.set_content(tmpls.render("open-vragen.html", data), "text/html");
   });
 
 
-  svr.Get("/besluiten.html", [&sqlw](const httplib::Request &req, httplib::Response &res) {
+  dbGet("/besluiten.html", [&sqlw, &tmpls](const httplib::Request &req, httplib::Response &res) {
     nlohmann::json data;
     string dlim = fmt::format("{:%Y-%m-%d}", fmt::localtime(time(0) - 8*86400));
     auto besluiten =  sqlw.queryJRet("select activiteit.datum, activiteit.nummer anummer, zaak.nummer znummer, agendapuntZaakBesluitVolgorde volg, besluit.status,agendapunt.onderwerp aonderwerp, zaak.onderwerp zonderwerp, naam indiener, besluit.tekst from besluit,agendapunt,activiteit,zaak left join zaakactor on zaakactor.zaakid = zaak.id and relatie='Indiener' where besluit.agendapuntid = agendapunt.id and activiteit.id = agendapunt.activiteitid and zaak.id = besluit.zaakid and datum > ? order by datum asc,agendapuntZaakBesluitVolgorde asc", {dlim});
@@ -969,20 +1284,17 @@ int main(int argc, char** argv)
 
     cout<<data.dump()<<endl;
     
-    inja::Environment e;
-    e.set_html_autoescape(true);
-
     data["pagemeta"]["title"]="";
     data["og"]["title"] = "Recente en toekomstige besluiten";
     data["og"]["description"] = "Recente en toekomstige besluiten in de Tweede Kamer";
     data["og"]["imageurl"] = "";
     
-    res.set_content(e.render_file("./partials/besluiten.html", data), "text/html");
+    res.set_content(tmpls.render("besluiten.html", data), "text/html");
   });
 
   
   // this is still alpine based though somehow!
-  svr.Get("/activiteit.html", [&sqlw](const httplib::Request &req, httplib::Response &res) {
+  dbGet("/activiteit.html", [&sqlw, &tmpls](const httplib::Request &req, httplib::Response &res) {
     string nummer=req.get_param_value("nummer");
     nlohmann::json data;
     auto act = sqlw.queryJRet("select * from Activiteit where nummer=?", {nummer});
@@ -992,18 +1304,16 @@ int main(int argc, char** argv)
       res.set_content("No such activity", "text/plain");
       return;
     }
-    inja::Environment e;
-    e.set_html_autoescape(true);
 
     data["pagemeta"]["title"]="";
     data["og"]["title"] = act[0]["onderwerp"];
     data["og"]["description"] = (string)act[0]["datum"] + ": "+ (string)act[0]["onderwerp"];
     data["og"]["imageurl"] = "";
     
-    res.set_content(e.render_file("./partials/activiteit.html", data), "text/html");
+    res.set_content(tmpls.render("activiteit.html", data), "text/html");
   });
 
-  svr.Get("/activiteiten.html", [&sqlw](const httplib::Request &req, httplib::Response &res) {
+  dbGet("/activiteiten.html", [&sqlw, &tmpls](const httplib::Request &req, httplib::Response &res) {
     // from 4 days ago into the future
     string dlim = fmt::format("{:%Y-%m-%d}", fmt::localtime(time(0)-4*86500));
     
@@ -1020,18 +1330,16 @@ int main(int argc, char** argv)
     }
     nlohmann::json data = nlohmann::json::object();
     data["data"] = acts;
-    inja::Environment e;
-    e.set_html_autoescape(false); // NOTE WELL!
 
     data["pagemeta"]["title"]="";
     data["og"]["title"] = "Activiteiten";
     data["og"]["description"] = "Activiteiten Tweede Kamer";
     data["og"]["imageurl"] = "";
     
-    res.set_content(e.render_file("./partials/activiteiten.html", data), "text/html");
+    res.set_content(tmpls.render("activiteiten.html", data, false), "text/html"); // NOTE WELL, no autoescape!
   });
 
-  svr.Get("/ongeplande-activiteiten.html", [&sqlw](const httplib::Request &req, httplib::Response &res) {
+  dbGet("/ongeplande-activiteiten.html", [&sqlw, &tmpls](const httplib::Request &req, httplib::Response &res) {
     auto acts = sqlw.queryJRet("select * from Activiteit where datum='' order by updated desc"); 
 
     for(auto& a : acts) {
@@ -1045,21 +1353,19 @@ int main(int argc, char** argv)
     }
     nlohmann::json data = nlohmann::json::object();
     data["data"] = acts;
-    inja::Environment e;
-    e.set_html_autoescape(false); // NOTE WELL!
 
     data["pagemeta"]["title"]="";
     data["og"]["title"] = "Nog ongeplande activiteiten";
     data["og"]["description"] = "Ongeplande activiteiten Tweede Kamer";
     data["og"]["imageurl"] = "";
     
-    res.set_content(e.render_file("./partials/ongeplande-activiteiten.html", data), "text/html");
+    res.set_content(tmpls.render("ongeplande-activiteiten.html", data, false), "text/html"); // NOTE WELL, no autoescape!
   });
 
 
   
   
-  svr.Get("/ksd.html", [&sqlw](const httplib::Request &req, httplib::Response &res) {
+  dbGet("/ksd.html", [&sqlw, &tmpls](const httplib::Request &req, httplib::Response &res) {
     int nummer=atoi(req.get_param_value("ksd").c_str()); // 36228
     string toevoeging=req.get_param_value("toevoeging").c_str();
     auto docs = sqlw.queryJRet("select document.nummer docnummer,* from Document,Kamerstukdossier where kamerstukdossier.nummer=? and kamerstukdossier.toevoeging=? and Document.kamerstukdossierid = kamerstukdossier.id order by volgnummer desc", {nummer, toevoeging});
@@ -1074,27 +1380,26 @@ int main(int argc, char** argv)
 
     if(!meta.empty())
       data["meta"] = packResultsJson(meta)[0];
-    inja::Environment e;
-    e.set_html_autoescape(true);
 
     data["pagemeta"]["title"]="";
     data["og"]["title"] = docs[0]["titel"];
     data["og"]["description"] = docs[0]["titel"];
     data["og"]["imageurl"] = "";
     
-    res.set_content(e.render_file("./partials/ksd.html", data), "text/html");
+    res.set_content(tmpls.render("ksd.html", data), "text/html");
   });
 
   
   
-  svr.Get("/get/:nummer", [&sqlw](const httplib::Request &req, httplib::Response &res) {
+  dbGet("/get/:nummer", [&sqlw](const httplib::Request &req, httplib::Response &res) {
     string nummer=req.path_params.at("nummer"); // 2023D41173
     res.status = 301;
     res.set_header("Location", "../document.html?nummer="+nummer);
     res.set_content("Redirecting..", "text/plain");
   });
 
-  svr.Get("/document.html", [&sqlw](const httplib::Request &req, httplib::Response &res) {
+  // not dbGet, this depends on the enclosure, its conversion and the User-Agent
+  svr.Get("/document.html", [&sqlw, &tmpls, &manifest, &conv, &mem](const httplib::Request &req, httplib::Response &res) {
     string nummer = req.get_param_value("nummer"); // 2023D41173
 
     nlohmann::json data = nlohmann::json::object();
@@ -1216,9 +1521,6 @@ int main(int argc, char** argv)
     });
     data["activiteiten"] = activiteiten;
 
-    inja::Environment e;
-    e.set_html_autoescape(false);
-
     data["pagemeta"]["title"]=get<string>(ret[0]["onderwerp"]);
     data["og"]["title"] = get<string>(ret[0]["onderwerp"]);
     data["og"]["description"] = get<string>(ret[0]["titel"]) + " " +get<string>(ret[0]["onderwerp"]);
@@ -1228,7 +1530,7 @@ int main(int argc, char** argv)
 
     if(!externeid.empty() && haveExternalIdFile(externeid)) {
       fmt::print("Got an external id present: {}\n", externeid);
-      data["content"] = getBareHtmlFromExternal(externeid);
+      data["content"] = *getBareHtmlFromExternal(mem, conv, externeid);
     }
     else if(get<string>(ret[0]["contentType"])=="application/pdf") {
       string agent;
@@ -1241,15 +1543,16 @@ int main(int argc, char** argv)
 	data["meta"]["iframe"]="getraw";
     }
     else {
-      data["content"] = getHtmlForDocument(documentId, true); // bare!
+      data["content"] = *getHtmlForDocument(mem, conv, manifest, documentId, true); // bare!
       data["meta"]["iframe"] = "getdoc";
     }
     
-    res.set_content(e.render_file("./partials/getorig.html", data), "text/html");
+    res.set_content(tmpls.render("getorig.html", data, false), "text/html");
   });
 
   
-  svr.Get("/verslag.html", [&sqlw](const httplib::Request &req, httplib::Response &res) {
+  // not dbGet either, the verslag itself comes from tkpull
+  svr.Get("/verslag.html", [&sqlw, &tmpls, &manifest, &conv, &mem](const httplib::Request &req, httplib::Response &res) {
     string id = req.get_param_value("vergaderingid"); // 9e79de98-e914-4dc8-8dc7-6d7cb09b93d7
     auto verslagen = sqlw.queryJRet("select *,substr(datum,0,11) datum from vergadering,verslag where verslag.vergaderingid=vergadering.id and status != 'Casco' and vergadering.id=? order by datum desc, verslag.updated desc limit 1", {id});
     if(verslagen.empty()) {
@@ -1268,20 +1571,17 @@ int main(int argc, char** argv)
     data["updated"] = fmt::format("{:%Y-%m-%d %H:%M}", fmt::localtime(then));
     // this accidentally gets the "right" id 
 
-    inja::Environment e;
-    e.set_html_autoescape(false); // XX 
-
     data["pagemeta"]["title"]=data["onderwerp"];
     data["og"]["title"] = data["onderwerp"];
     data["og"]["description"] = (string)data["titel"];
     data["og"]["imageurl"] = "";
 
     bulkEscape(data); 
-    data["htmlverslag"]=getHtmlForDocument(data["id"], true);
-    res.set_content(e.render_file("./partials/verslag.html", data), "text/html");
+    data["htmlverslag"]=*getHtmlForDocument(mem, conv, manifest, data["id"], true);
+    res.set_content(tmpls.render("verslag.html", data, false), "text/html"); // XX no autoescape
   });
 
-  svr.Get("/verslagen", [&sqlw](const httplib::Request &req, httplib::Response &res) {
+  cachedGet("/verslagen", "/verslagen", [&sqlw](const httplib::Request &req, httplib::Response &res) {
     
     auto verslagen = sqlw.query("select * from vergadering,verslag where verslag.vergaderingid=vergadering.id and datum > '2023-01-01' and status != 'Casco' order by datum desc, verslag.updated desc");
 
@@ -1305,7 +1605,7 @@ int main(int argc, char** argv)
   });
 
   
-  svr.Get("/open-toezeggingen", [&sqlw](const httplib::Request &req, httplib::Response &res) {
+  cachedGet("/open-toezeggingen", "/open-toezeggingen", [&sqlw](const httplib::Request &req, httplib::Response &res) {
     
     auto docs = sqlw.query("select toezegging.id, tekst, toezegging.nummer, ministerie, status, naamToezegger,activiteit.datum, kamerbriefNakoming, datumNakoming, activiteit.nummer activiteitNummer, initialen, tussenvoegsel, achternaam, functie, fractie.afkorting as fractienaam, voortouwAfkorting from Toezegging,Activiteit left join Persoon on persoon.id = toezegging.persoonId left join Fractie on fractie.id = toezegging.fractieId where  Toezegging.activiteitId = activiteit.id and status != 'Voldaan' order by activiteit.datum desc");
     res.set_content(packResultsJsonStr(docs), "application/json");
@@ -1316,7 +1616,7 @@ int main(int argc, char** argv)
   // create table openvragen as select Zaak.id, Zaak.gestartOp, zaak.nummer, min(document.nummer) as docunummer, zaak.onderwerp, count(1) filter (where Document.soort="Schriftelijke vragen") as numvragen, count(1) filter (where Document.soort like "Antwoord schriftelijke vragen%" or (Document.soort="Mededeling" and (document.onderwerp like '%ingetrokken%' or document.onderwerp like '%intrekken%'))) as numantwoorden  from Zaak, Link, Document where Zaak.id = Link.naar and Document.id = Link.van and Zaak.gestartOp > '2019-09-09' group by 1, 3 having numvragen > 0 and numantwoorden==0 order by 2 desc
 
 
-  svr.Get("/recent-kamerstukdossiers", [&sqlw](const httplib::Request &req, httplib::Response &res) {
+  cachedGet("/recent-kamerstukdossiers", "/recent-kamerstukdossiers", [&sqlw](const httplib::Request &req, httplib::Response &res) {
     
     auto docs = sqlw.query("select kamerstukdossier.nummer, max(document.datum) mdatum,kamerstukdossier.titel,kamerstukdossier.toevoeging,hoogsteVolgnummer from kamerstukdossier,document where document.kamerstukdossierid=kamerstukdossier.id and document.datum > '2020-01-01' group by kamerstukdossier.id,toevoeging order by 2 desc");
     // XXX hardcoded date
@@ -1327,7 +1627,7 @@ int main(int argc, char** argv)
   
   // select * from persoonGeschenk, Persoon where Persoon.id=persoonId order by Datum desc
 
-  svr.Get("/geschenken", [&sqlw](const httplib::Request &req, httplib::Response &res) {
+  cachedGet("/geschenken", "/geschenken", [&sqlw](const httplib::Request &req, httplib::Response &res) {
     auto docs = sqlw.query("select datum, omschrijving, functie, initialen, tussenvoegsel, roepnaam, achternaam, gewicht,nummer from persoonGeschenk, Persoon where Persoon.id=persoonId and datum > '2019-01-01' order by Datum desc"); 
     res.set_content(packResultsJsonStr(docs), "application/json");
     fmt::print("Returned {} geschenken\n", docs.size());
@@ -1342,7 +1642,7 @@ int main(int argc, char** argv)
      
   */
 
-  svr.Get("/stemmingen", [&sqlw](const httplib::Request &req, httplib::Response &res) {
+  cachedGet("/stemmingen", "/stemmingen", [&sqlw](const httplib::Request &req, httplib::Response &res) {
     auto besluiten = sqlw.query("select besluit.id as besluitid, besluit.soort as besluitsoort, besluit.tekst as besluittekst, besluit.opmerking as besluitopmerking, activiteit.datum, activiteit.nummer anummer, zaak.nummer znummer, agendapuntZaakBesluitVolgorde volg, besluit.status,agendapunt.onderwerp aonderwerp, zaak.onderwerp zonderwerp, naam indiener from besluit,agendapunt,activiteit,zaak left join zaakactor on zaakactor.zaakid = zaak.id and relatie='Indiener' where besluit.agendapuntid = agendapunt.id and activiteit.id = agendapunt.activiteitid and zaak.id = besluit.zaakid and datum < '2024-10-20' and datum > '2024-08-13' order by datum desc,agendapuntZaakBesluitVolgorde asc"); // XX hardcoded date
 
     nlohmann::json j = nlohmann::json::array();
@@ -1376,14 +1676,14 @@ int main(int argc, char** argv)
   });
 
   
-  svr.Get("/unplanned-activities", [&sqlw](const httplib::Request &req, httplib::Response &res) {
+  cachedGet("/unplanned-activities", "/unplanned-activities", [&sqlw](const httplib::Request &req, httplib::Response &res) {
     auto docs = sqlw.query("select * from Activiteit where datum='' order by updated desc"); 
     res.set_content(packResultsJsonStr(docs), "application/json");
     fmt::print("Returned {} unplanned activities\n", docs.size());
   });
 
 
-  svr.Get("/future-besluiten", [&sqlw](const httplib::Request &req, httplib::Response &res) {
+  cachedGet("/future-besluiten", "/future-besluiten", [&sqlw](const httplib::Request &req, httplib::Response &res) {
     string dlim = fmt::format("{:%Y-%m-%d}", fmt::localtime(time(0) - 8*86400));
     auto docs = sqlw.query("select activiteit.datum, activiteit.nummer anummer, zaak.nummer znummer, agendapuntZaakBesluitVolgorde volg, besluit.status,agendapunt.onderwerp aonderwerp, zaak.onderwerp zonderwerp, naam indiener, besluit.tekst from besluit,agendapunt,activiteit,zaak left join zaakactor on zaakactor.zaakid = zaak.id and relatie='Indiener' where besluit.agendapuntid = agendapunt.id and activiteit.id = agendapunt.activiteitid and zaak.id = besluit.zaakid and datum > ? order by datum asc,agendapuntZaakBesluitVolgorde asc", {dlim}); 
     
@@ -1393,7 +1693,7 @@ int main(int argc, char** argv)
 
 
   
-  svr.Get("/future-activities", [&sqlw](const httplib::Request &req, httplib::Response &res) {
+  cachedGet("/future-activities", "/future-activities", [&sqlw](const httplib::Request &req, httplib::Response &res) {
     auto docs = sqlw.query("select Activiteit.datum datum, activiteit.bijgewerkt bijgewerkt, activiteit.nummer nummer, naam, noot, onderwerp,voortouwAfkorting from Activiteit left join Reservering on reservering.activiteitId=activiteit.id  left join Zaal on zaal.id=reservering.zaalId where datum > '2024-09-29' order by datum asc"); // XX hardcoded date
 
     res.set_content(packResultsJsonStr(docs), "application/json");
@@ -1401,7 +1701,7 @@ int main(int argc, char** argv)
   });
 
 
-  svr.Post("/search", [&sqlw](const httplib::Request &req, httplib::Response &res) {
+  svr.Post("/search", [&idxsqw, &textcache, ftsfrom, ftsjoin, ftssnip](const httplib::Request &req, httplib::Response &res) {
     string term = req.get_file_value("q").content;
     string twomonths = req.get_file_value("twomonths").content;
     string soorten = req.get_file_value("soorten").content;
@@ -1415,26 +1715,26 @@ int main(int argc, char** argv)
       term = "\"" + term + "\"";
     }
     
-    SQLiteWriter idx("tkindex.sqlite3");
-    idx.query("ATTACH DATABASE 'tk.sqlite3' as meta");
-    idx.query("ATTACH DATABASE ':memory:' as tmp");
     cout<<"Search: '"<<term<<"', limit '"<<limit<<"', soorten: '"<<soorten<<"'"<<endl;
     DTime dt;
     dt.start();
+    // we need the same connection for all queries below, because of the temp table
+    auto idx = idxsqw.getConnection();
     std::vector<std::unordered_map<std::string,MiniSQLite::outvar_t>> matches; // ugh
     if(soorten=="moties") {
-      matches = idx.queryT("SELECT uuid, soort, Document.onderwerp, Document.titel, document.nummer, document.bijgewerkt, document.datum, snippet(docsearch,-1, '<b>', '</b>', '...', 20) as snip, bm25(docsearch) as score, category FROM docsearch, meta.document WHERE docsearch match ? and document.id = uuid and document.datum > ? and document.soort='Motie' order by score limit 280", {term, limit});
+      matches = idx->queryT("SELECT uuid, soort, Document.onderwerp, Document.titel, document.nummer, document.bijgewerkt, document.datum, "+ftssnip+" as snip, bm25(docsearch) as score, category FROM "+ftsfrom+", meta.document WHERE "+ftsjoin+"docsearch match ? and document.id = uuid and document.datum > ? and document.soort='Motie' order by score limit 280", {term, limit});
     }
     else if(soorten=="vragenantwoorden") {
-      matches = idx.queryT("SELECT uuid, soort, Document.onderwerp, Document.titel, document.nummer, document.bijgewerkt, document.datum, snippet(docsearch,-1, '<b>', '</b>', '...', 20) as snip, bm25(docsearch) as score, category FROM docsearch, meta.document WHERE docsearch match ? and document.id = uuid and document.datum > ? and document.soort in ('Schriftelijke vragen', 'Antwoord schriftelijke vragen', 'Antwoord schriftelijke vragen (nader)')  order by score limit 280", {term, limit});
+      matches = idx->queryT("SELECT uuid, soort, Document.onderwerp, Document.titel, document.nummer, document.bijgewerkt, document.datum, "+ftssnip+" as snip, bm25(docsearch) as score, category FROM "+ftsfrom+", meta.document WHERE "+ftsjoin+"docsearch match ? and document.id = uuid and document.datum > ? and document.soort in ('Schriftelijke vragen', 'Antwoord schriftelijke vragen', 'Antwoord schriftelijke vragen (nader)')  order by score limit 280", {term, limit});
     }
     else {
       // put the matches in a temporary table
-      idx.queryT("create table tmp.uuids as SELECT uuid, snippet(docsearch,-1, '<b>', '</b>', '...', 20) as snip, bm25(docsearch) as score, category FROM docsearch WHERE docsearch match ? and datum > ? order by score limit 280", {term, limit});
+      idx->queryT("delete from temp.uuids");
+      idx->queryT("insert into temp.uuids SELECT uuid, "+ftssnip+" as snip, bm25(docsearch) as score, category FROM "+ftsfrom+" WHERE "+ftsjoin+"docsearch match ? and datum > ? order by score limit 280", {term, limit});
       
-      matches =  idx.queryT("select uuid,meta.Document.onderwerp, meta.Document.bijgewerkt, meta.Document.titel, nummer, datum, snip, score FROM uuids,meta.Document where tmp.uuids.uuid=Document.id");
+      matches =  idx->queryT("select uuid,meta.Document.onderwerp, meta.Document.bijgewerkt, meta.Document.titel, nummer, datum, snip, score FROM temp.uuids,meta.Document where temp.uuids.uuid=Document.id");
       
-      auto matchesVerslag = idx.queryT("SELECT uuid,meta.Vergadering.titel as onderwerp, meta.Vergadering.id as vergaderingId, meta.Verslag.updated as bijgewerkt, '' as titel, nummer, datum, snip, score FROM uuids, meta.Verslag, meta.Vergadering WHERE uuid = Verslag.id and Vergadering.id = Verslag.vergaderingId");
+      auto matchesVerslag = idx->queryT("SELECT uuid,meta.Vergadering.titel as onderwerp, meta.Vergadering.id as vergaderingId, meta.Verslag.updated as bijgewerkt, '' as titel, nummer, datum, snip, score FROM temp.uuids, meta.Verslag, meta.Vergadering WHERE uuid = Verslag.id and Vergadering.id = Verslag.vergaderingId");
       
       for(auto& mv : matchesVerslag) {
 	/*
@@ -1448,6 +1748,17 @@ int main(int argc, char** argv)
 	matches.push_back(mv);
       }
     }
+    // only for what we send back, and only from the start of the text
+    if(textcache) {
+      unordered_map<string, string> snips;
+      for(auto& m : matches) {
+        string uuid = get<string>(m["uuid"]);
+        if(auto iter = snips.find(uuid); iter != snips.end())
+          m["snip"] = iter->second;
+        else if(auto text = textcache->getPrefix(uuid, g_snippetscan))
+          m["snip"] = snips[uuid] = makeSnippet(*text, term);
+      }
+    }
     auto usec = dt.lapUsec();
     fmt::print("Got {} matches in {} msec\n", matches.size(), usec/1000.0);
     nlohmann::json response=nlohmann::json::object();
@@ -1463,6 +1774,11 @@ int main(int argc, char** argv)
     char buf[BUFSIZ];
     try {
       std::rethrow_exception(ep);
+    } catch (ConversionService::Busy &e) {
+      res.set_header("Retry-After", "5");
+      res.set_content("Too busy converting documents, please try again in a few seconds", "text/plain");
+      res.status = 503;
+      return;
     } catch (std::exception &e) {
       snprintf(buf, sizeof(buf), fmt, e.what());
     } catch (...) { // See the following NOTE
@@ -1485,7 +1801,39 @@ int main(int argc, char** argv)
   int port = 8089;
   if(argc > 1)
     port = atoi(argv[1]);
+  // warms the response cache at startup and after an ingest, which is over once the data version stops changing
+  std::atomic<bool> warmstop{false};
+  thread warmer([&]() {
+    uint64_t warmed = 0, last = 0;
+    while(!warmstop) {
+      uint64_t v = dataversion.get();
+      if(v != warmed && v == last) {
+        DTime dt;
+        dt.start();
+        for(const auto& w : warmers) {
+          httplib::Request req;
+          req.method = "GET";
+          req.path = w.first;
+          httplib::Response res;
+          try {
+            w.second(req, res);
+          }
+          catch(std::exception& e) {
+            fmt::print("Error warming {}: {}\n", w.first, e.what());
+          }
+        }
+        fmt::print("Warmed {} cached responses in {:.1f} msec\n", warmers.size(), dt.lapUsec() / 1000.0);
+        warmed = v;
+      }
+      last = v;
+      this_thread::sleep_for(chrono::seconds(2));
+    }
+  });
+
   fmt::print("Listening on port {} serving html from {}\n",
 	     port, root);
   svr.listen("0.0.0.0", port);
+  // it uses svr's handlers and our caches
+  warmstop = true;
+  warmer.join();
 }
@@ -0,0 +1,135 @@
+#include "xmlcompress.hh"
+#include <stdexcept>
+#include <zstd.h>
+#include <zdict.h>
+
+using namespace std;
+
+struct XMLCompressor::Dict
+{
+  explicit Dict(const vector<uint8_t>& dict)
+  {
+    d_cdict = ZSTD_createCDict(dict.data(), dict.size(), 9); // beyond this initial syncs get slow
+    d_ddict = ZSTD_createDDict(dict.data(), dict.size());
+    d_id = ZSTD_getDictID_fromDict(dict.data(), dict.size());
+    if(!d_cdict || !d_ddict || !d_id)
+      throw runtime_error("Invalid zstd dictionary");
+  }
+  ~Dict()
+  {
+    ZSTD_freeCDict(d_cdict);
+    ZSTD_freeDDict(d_ddict);
+  }
+  Dict(const Dict&) = delete;
+  Dict& operator=(const Dict&) = delete;
+  ZSTD_CDict* d_cdict;
+  ZSTD_DDict* d_ddict;
+  unsigned int d_id;
+};
+
+// zstd contexts are expensive to make and not thread safe, so every thread gets its own
+static ZSTD_CCtx* getCCtx()
+{
+  thread_local unique_ptr<ZSTD_CCtx, decltype(&ZSTD_freeCCtx)> ctx(ZSTD_createCCtx(), &ZSTD_freeCCtx);
+  return ctx.get();
+}
+
+static ZSTD_DCtx* getDCtx()
+{
+  thread_local unique_ptr<ZSTD_DCtx, decltype(&ZSTD_freeDCtx)> ctx(ZSTD_createDCtx(), &ZSTD_freeDCtx);
+  return ctx.get();
+}
+
+XMLCompressor::XMLCompressor(SQLiteWriter& xmlstore)
+{
+  // readers don't get to write, no table is no dictionaries. train() makes it
+  if(xmlstore.queryT("select 1 from sqlite_master where type='table' and name='xmldicts'").empty())
+    return;
+  // in order, so the newest dictionary for a category wins
+  auto rows = xmlstore.queryT("select category, dict from xmldicts order by rowid");
+  for(auto& r : rows)
+    addDict(get<string>(r["category"]), get<vector<uint8_t>>(r["dict"]));
+}
+
+void XMLCompressor::addDict(const std::string& category, const std::vector<uint8_t>& dict)
+{
+  auto d = make_shared<Dict>(dict);
+  d_bycat[category] = d;
+  d_byid[d->d_id] = d;
+}
+
+vector<uint8_t> XMLCompressor::trainDict(const vector<string>& samples, size_t dictsize)
+{
+  string buffer;
+  vector<size_t> sizes;
+  for(const auto& s : samples) {
+    buffer.append(s);
+    sizes.push_back(s.size());
+  }
+  vector<uint8_t> dict(dictsize);
+  size_t res = ZDICT_trainFromBuffer(dict.data(), dict.size(), buffer.c_str(), sizes.data(), sizes.size());
+  if(ZDICT_isError(res))
+    throw runtime_error(string("Could not train zstd dictionary: ")+ZDICT_getErrorName(res));
+  dict.resize(res);
+  return dict;
+}
+
+bool XMLCompressor::train(SQLiteWriter& xmlstore, const std::string& category)
+{
+  auto rows = xmlstore.queryT("select xml from "+category+" where typeof(xml)='text' order by rowid desc limit 10000");
+  if(rows.size() < 100)
+    return false;
+  vector<string> samples;
+  for(auto& r : rows)
+    samples.push_back(get<string>(r["xml"]));
+
+  auto dict = trainDict(samples);
+  addDict(category, dict);
+  xmlstore.query("create table if not exists xmldicts (category TEXT, dictid INT PRIMARY KEY, dict BLOB)");
+  xmlstore.addValue({{"category", category}, {"dictid", (int64_t)d_bycat[category]->d_id}, {"dict", dict}}, "xmldicts");
+  return true;
+}
+
+vector<uint8_t> XMLCompressor::compress(const std::string& category, const std::string& xml) const
+{
+  auto iter = d_bycat.find(category);
+  if(iter == d_bycat.end())
+    throw runtime_error("No zstd dictionary for category "+category);
+  vector<uint8_t> ret(ZSTD_compressBound(xml.size()));
+  size_t res = ZSTD_compress_usingCDict(getCCtx(), ret.data(), ret.size(), xml.c_str(), xml.size(), iter->second->d_cdict);
+  if(ZSTD_isError(res))
+    throw runtime_error(string("Could not compress XML: ")+ZSTD_getErrorName(res));
+  ret.resize(res);
+  return ret;
+}
+
+string XMLCompressor::getXML(const MiniSQLite::outvar_t& val) const
+{
+  if(auto str = get_if<string>(&val))
+    return *str;
+
+  const auto& blob = get<vector<uint8_t>>(val);
+  string ret;
+  decompress(blob.data(), blob.size(), ret);
+  return ret;
+}
+
+void XMLCompressor::decompress(const uint8_t* data, size_t len, std::string& out) const
+{
+  auto outlen = ZSTD_getFrameContentSize(data, len);
+  if(outlen == ZSTD_CONTENTSIZE_ERROR || outlen == ZSTD_CONTENTSIZE_UNKNOWN)
+    throw runtime_error("Blob in xml column is not a zstd frame we made");
+
+  const ZSTD_DDict* ddict = nullptr;
+  if(auto id = ZSTD_getDictID_fromFrame(data, len)) {
+    auto iter = d_byid.find(id);
+    if(iter == d_byid.end())
+      throw runtime_error("No zstd dictionary with id "+to_string(id));
+    ddict = iter->second->d_ddict;
+  }
+  out.resize(outlen);
+  size_t res = ZSTD_decompress_usingDDict(getDCtx(), out.data(), out.size(), data, len, ddict);
+  if(ZSTD_isError(res))
+    throw runtime_error(string("Could not decompress XML: ")+ZSTD_getErrorName(res));
+  out.resize(res);
+}
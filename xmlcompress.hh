@@ -0,0 +1,36 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <memory>
+#include <unordered_map>
+#include "sqlwriter.hh"
+
+/* Optional zstd compression for the xml column in xml.sqlite3.
+   Every category gets its own trained dictionary, stored in the xmldicts table, which only train() creates.
+   Compressed rows are blobs, plain rows stay text, and getXML() does the right thing for both,
+   so a database can be converted bit by bit. Dictionaries are never deleted, old rows may need them.
+
+   Loading and training are not thread safe, compress() and getXML() are */
+class XMLCompressor
+{
+public:
+  explicit XMLCompressor(SQLiteWriter& xmlstore);
+  bool haveDict(const std::string& category) const
+  {
+    return d_bycat.count(category);
+  }
+  // trains on the newest plain text rows of category, returns false if there were too few of them
+  bool train(SQLiteWriter& xmlstore, const std::string& category);
+  std::vector<uint8_t> compress(const std::string& category, const std::string& xml) const;
+  // accepts both a compressed blob and plain text
+  std::string getXML(const MiniSQLite::outvar_t& val) const;
+  // decompresses a blob from the xml column into out, reusing the memory it already has
+  void decompress(const uint8_t* data, size_t len, std::string& out) const;
+
+  static std::vector<uint8_t> trainDict(const std::vector<std::string>& samples, size_t dictsize = 112640);
+  void addDict(const std::string& category, const std::vector<uint8_t>& dict);
+private:
+  struct Dict;
+  std::unordered_map<std::string, std::shared_ptr<Dict>> d_bycat;
+  std::unordered_map<unsigned int, std::shared_ptr<Dict>> d_byid;
+};